@@ -8,11 +8,122 @@
  * Creative Commons Attribution-Share-Alike License 3.0 (https://creativecommons.org/licenses/by-sa/3.0/)
  */
 
+#if defined(SHUNTING_LIBRARY)
+#include "shunting.h" // The C interface; the library leaves out the command line and with it iostream.
+#include <new>      // nothrow
+#else
 #include <iostream> // cout && getline
+#endif
+#include <sstream>  // istringstream
+#include <fstream>  // ifstream
 #include <string>   // string
 #include <vector>   // vector
 #include <deque>    // deque
+#include <array>    // array
+#include <unordered_map> // unordered_map
+#include <memory>   // shared_ptr
 #include <cmath>    // pow
+#include <complex>  // complex
+#include <cstring>  // memcpy
+#include <cerrno>   // errno
+#include <cstdint>  // int32_t
+#include <algorithm> // min && fill_n
+#include <chrono>   // steady_clock
+#include <random>   // mt19937
+#include <iomanip>  // setw
+#include <limits>   // numeric_limits
+#include <thread>   // thread
+#include <atomic>   // atomic
+#include <mutex>    // mutex
+#include <condition_variable> // condition_variable
+#include <functional> // function
+#include <exception> // exception_ptr
+#include <future>   // promise && shared_future
+#include <stdexcept> // runtime_error
+#include <sys/socket.h> // socket && accept
+#include <netinet/in.h> // sockaddr_in
+#include <arpa/inet.h>  // htons
+#include <unistd.h>     // close && ftruncate && isatty
+#include <sys/mman.h>   // shm_open && mmap
+#include <sys/stat.h>   // fstat
+#include <fcntl.h>      // O_CREAT
+#if defined(__SSE__)
+#include <xmmintrin.h> // _mm_sqrt_ps
+#endif
+#if defined(__F16C__)
+#include <immintrin.h> // _mm256_cvtph_ps
+#endif
+
+/* An expression that cannot be evaluated. The command line modes print it and exit; the server answers with it. */
+class evalError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+template <typename... Parts>
+[[noreturn]] void fail(const Parts &...parts) {
+    std::ostringstream message {};
+    (message << ... << parts);
+    throw evalError {message.str()};
+}
+
+/*
+ * Stops an evaluation from another thread, or once a deadline passes. The
+ * lexer, the parser and the evaluators call checkCancelled every so many
+ * steps and per batch tile; it fails with evalError once the token of the
+ * calling thread, installed by a cancellationScope, is cancelled or expired.
+ */
+class cancellation {
+public:
+    cancellation() = default;
+    explicit cancellation(std::chrono::steady_clock::duration timeout) : deadline {std::chrono::steady_clock::now() + timeout} {}
+
+    /* Safe from any thread. */
+    void cancel() {
+        cancelled.store(true, std::memory_order_relaxed);
+    }
+
+    std::atomic<bool> cancelled {false};
+    std::chrono::steady_clock::time_point deadline {std::chrono::steady_clock::time_point::max()};
+};
+
+/* The token checkCancelled tests on this thread; parallelFor hands it on to its workers. */
+thread_local const cancellation *activeCancellation {nullptr};
+
+class cancellationScope {
+public:
+    explicit cancellationScope(const cancellation *token) : outer {activeCancellation} {
+        activeCancellation = token;
+    }
+
+    cancellationScope(const cancellationScope &) = delete;
+    cancellationScope &operator=(const cancellationScope &) = delete;
+
+    ~cancellationScope() {
+        activeCancellation = outer;
+    }
+
+private:
+    const cancellation *outer;
+};
+
+/* Steps the lexer, parser and scalar evaluators take between calls to checkCancelled. */
+constexpr size_t cancellationInterval {1024};
+
+inline void checkCancelled() {
+    const cancellation *token {activeCancellation};
+    if (token == nullptr) {
+        return;
+    }
+
+    if (token->cancelled.load(std::memory_order_relaxed)) {
+        fail("Cancelled");
+    }
+
+    if (token->deadline != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() >= token->deadline) {
+        fail("Deadline exceeded");
+    }
+}
 
 enum class tokenType {
     nil,
@@ -25,7 +136,39 @@ enum class tokenType {
     mod,
     exp,
     i32,
-    f32
+    f32,
+    sep,
+    fun,
+    var,
+    call,
+    arg,
+    lt,
+    gt,
+    le,
+    ge,
+    eq,
+    ne,
+    land,
+    lor,
+    qst,
+    col,
+    jz,
+    jmp,
+    img,
+    lbr,
+    rbr,
+    form,
+    addk, // Superinstructions of fuse: a binary operator whose right operand is the literal in fltData,
+    subk,
+    mulk,
+    divk,
+    addv, // or the variable in slot,
+    subv,
+    mulv,
+    divv,
+    fma,  // and multiply-adds a * b + c, with c from the stack, fltData or slot.
+    fmak,
+    fmav
 };
 
 class token {
@@ -37,15 +180,22 @@ public:
     }
 
     std::string strData {};
-    long intData {};
+    long intData {}; // Also the number of tokens a jz or jmp skips, and a literal's scaled units in decimal mode.
     float fltData {};
     size_t precedence {};
     tokenType type {tokenType::nil};
     bool rAssociative {false};
     bool unary {false};
+    size_t argc {};  // Argument count of a function call, element count of an array.
+    size_t slot {};  // Builtin, form or user function index, binding index of a variable, parameter index of an arg.
+    std::shared_ptr<const std::deque<token>> body {}; // Subprogram of a form, once lowerForms has run; intData is its variable's slot.
+
+    [[nodiscard]] static const char *typeName(tokenType type) {
+        return tokenTypeStrings[(int)type];
+    }
 
 private:
-    const std::vector<const char *> tokenTypeStrings {
+    static inline const std::vector<const char *> tokenTypeStrings {
             "nil",
             "lpa",
             "rpa",
@@ -56,387 +206,6980 @@ private:
             "mod",
             "exp",
             "i32",
-            "f32"
+            "f32",
+            "sep",
+            "fun",
+            "var",
+            "call",
+            "arg",
+            "lt",
+            "gt",
+            "le",
+            "ge",
+            "eq",
+            "ne",
+            "land",
+            "lor",
+            "qst",
+            "col",
+            "jz",
+            "jmp",
+            "img",
+            "lbr",
+            "rbr",
+            "form",
+            "addk",
+            "subk",
+            "mulk",
+            "divk",
+            "addv",
+            "subv",
+            "mulv",
+            "divv",
+            "fma",
+            "fmak",
+            "fmav"
     };
 };
 
-class lexana {
-public:
-    /* For debugging lexer output. */
-    [[maybe_unused]] [[nodiscard]] std::string toString() const {
-        std::string s {"[\n"};
-        for (const token &t: formatTokens) {
-            s += '\t' + t.toString() + '\n';
-        }
-        s += ']';
-        return s;
-    }
+/*
+ * SIMD kernels used by batch mode. Each works on 4 lanes at a time through the
+ * GCC/Clang vector extensions, so they compile to SSE/NEON without intrinsics.
+ * The transcendental ones are the Cephes single precision polynomials; the
+ * error bounds below were measured against double precision libm over the
+ * stated domains.
+ */
+typedef float vfloat __attribute__((vector_size(16)));
+typedef int32_t vint __attribute__((vector_size(16)));
+constexpr size_t vlanes {4};
 
-    [[nodiscard]] std::vector<token> &getTokens() {
-        return formatTokens;
-    }
+static inline vfloat vsplat(float f) {
+    return vfloat {f, f, f, f};
+}
 
-    void lex(const std::string &_data) {
-        data = _data;
+static inline vfloat vselect(vint mask, vfloat a, vfloat b) {
+    return (vfloat)((mask & (vint)a) | (~mask & (vint)b));
+}
 
-        for (size_t i {0}; i < data.size(); ++i) {
-        _again:
-            char c {data[i]};
-            token t {};
+static inline vfloat vtrunc(vfloat x) {
+    return __builtin_convertvector(__builtin_convertvector(x, vint), vfloat);
+}
 
-            switch (c) {
-                case ' ':
-                case '\t':
-                case '\n':
-                case '\r':
-                    ++i;
-                    goto _again;
+/* Exact. */
+static inline vfloat vabs(vfloat x) {
+    return (vfloat)((vint)x & 0x7fffffff);
+}
 
-                case '(':
-                    t.type = tokenType::lpa;
-                    t.strData = '(';
-                    t.precedence = 9;
-                    t.rAssociative = false;
-                    break;
+/* Exact. */
+static inline vfloat vfloor(vfloat x) {
+    vfloat t {vtrunc(x)};
+    t -= vselect(t > x, vsplat(1.0f), vsplat(0.0f));
+    return vselect(vabs(x) < 8388608.0f, t, x);
+}
 
-                case ')':
-                    t.type = tokenType::rpa;
-                    t.strData = ')';
-                    t.precedence = 0;
-                    t.rAssociative = false;
-                    break;
+/* Max 1 ULP on [-87.3, 88.7]; below that the result is flushed to 0, above it is +inf. */
+static inline vfloat vexp(vfloat x) {
+    const vint over {x > 88.7228391f};
+    const vint under {x < -87.3365447f};
+    x = vselect(under, vsplat(0.0f), vselect(over, vsplat(0.0f), x));
 
-                case '+':
-                    t.type = tokenType::add;
-                    t.strData = '+';
-                    t.precedence = 2;
-                    t.rAssociative = false;
-                    break;
+    vfloat fx {vfloor(x * 1.44269504088896341f + 0.5f)};
+    x = x - fx * 0.693359375f + fx * 2.12194440e-4f;
 
-                case '-':
-                    if (formatTokens.empty() || (formatTokens.back().type == tokenType::add
-                                                 || formatTokens.back().type == tokenType::sub
-                                                 || formatTokens.back().type == tokenType::div
-                                                 || formatTokens.back().type == tokenType::mul
-                                                 || formatTokens.back().type == tokenType::mod
-                                                 || formatTokens.back().type == tokenType::exp)
-                        || formatTokens.back().type == tokenType::lpa) {
-                        t.unary = true;
-                        t.precedence = 5;
-                        t.rAssociative = false;
-                        t.strData = 'm';
-                        t.precedence = 5;
-                        t.type = tokenType::sub;
-                    }
-                    else {
-                        t.type = tokenType::sub;
-                        t.strData = '-';
-                        t.precedence = 2;
-                        t.rAssociative = false;
-                    }
-                    break;
+    vfloat p {vsplat(1.9875691500e-4f)};
+    p = p * x + 1.3981999507e-3f;
+    p = p * x + 8.3334519073e-3f;
+    p = p * x + 4.1665795894e-2f;
+    p = p * x + 1.6666665459e-1f;
+    p = p * x + 5.0000001201e-1f;
+    p = p * x * x + x + 1.0f;
 
-                case '/':
-                    t.type = tokenType::div;
-                    t.strData = '/';
-                    t.precedence = 3;
-                    t.rAssociative = false;
-                    break;
+    /* Scale by 2^n in two steps so that n = 128 does not overflow the exponent field. */
+    const vint n {__builtin_convertvector(fx, vint)};
+    const vint half {n >> 1};
+    p *= (vfloat)((half + 127) << 23);
+    p *= (vfloat)((n - half + 127) << 23);
 
-                case '*':
-                case 'x':
-                    t.type = tokenType::mul;
-                    t.strData = '*';
-                    t.precedence = 3;
-                    t.rAssociative = false;
-                    break;
+    p = vselect(over, vsplat(HUGE_VALF), p);
+    return vselect(under, vsplat(0.0f), p);
+}
 
-                case '%':
-                    t.type = tokenType::mod;
-                    t.strData = '%';
-                    t.precedence = 6;
-                    t.rAssociative = false;
-                    break;
+/* Max 1 ULP for normal positive inputs; 0 gives -inf, negatives give NaN, denormals are not supported. */
+static inline vfloat vlog(vfloat x) {
+    const vint invalid {(x < 0.0f) | (x != x)};
+    const vint zero {x == 0.0f};
+    const vint inf {x == HUGE_VALF};
 
-                case '^':
-                    t.type = tokenType::exp;
-                    t.strData = '^';
-                    t.precedence = 4;
-                    t.rAssociative = true;
-                    break;
+    vint bits {(vint)x};
+    vfloat e {__builtin_convertvector(((bits >> 23) & 0xff) - 126, vfloat)};
+    x = (vfloat)((bits & 0x007fffff) | 0x3f000000);
 
-                case '0':
-                case '9':
-                case '8':
-                case '7':
-                case '6':
-                case '5':
-                case '4':
-                case '3':
-                case '2':
-                case '1': {
-                    std::string floatStr {};
-                    t.type = tokenType::i32;
+    const vint small {x < 0.707106781186547524f};
+    e -= vselect(small, vsplat(1.0f), vsplat(0.0f));
+    x = x + vselect(small, x, vsplat(0.0f)) - 1.0f;
 
-                    while (std::isdigit(c) || c == '_' || c == '.') {
-                        if (c == '_') {
-                            c = data[++i];
-                            continue;
-                        }
-                        else if (c == '.') {
-                            if (t.type == tokenType::f32) {
-                                std::cerr << "Redefinition of float: " << t.toString() << '\n';
-                                exit(1);
-                            }
-                            else {
-                                t.type = tokenType::f32;
-                                floatStr += '.';
-                            }
-                        }
-                        else {
-                            floatStr += c;
-                        }
+    const vfloat z {x * x};
+    vfloat y {vsplat(7.0376836292e-2f)};
+    y = y * x - 1.1514610310e-1f;
+    y = y * x + 1.1676998740e-1f;
+    y = y * x - 1.2420140846e-1f;
+    y = y * x + 1.4249322787e-1f;
+    y = y * x - 1.6668057665e-1f;
+    y = y * x + 2.0000714765e-1f;
+    y = y * x - 2.4999993993e-1f;
+    y = y * x + 3.3333331174e-1f;
+    y = y * x * z;
 
-                        c = data[++i];
-                    }
+    y += e * -2.12194440e-4f;
+    y -= 0.5f * z;
+    x = x + y + e * 0.693359375f;
 
-                    if (t.type == tokenType::f32) {
-                        t.fltData = std::stof(floatStr);
-                    }
-                    else {
-                        t.intData = std::stoi(floatStr);
-                    }
+    x = vselect(inf, vsplat(HUGE_VALF), x);
+    x = vselect(zero, vsplat(-HUGE_VALF), x);
+    return vselect(invalid, vsplat(NAN), x);
+}
 
-                    --i; // Let for loop skip last char.
+/* Shared octant reduction of vsin and vcos. */
+static inline void vreduce(vfloat x, vfloat &r, vint &octant) {
+    octant = __builtin_convertvector(x * 1.27323954473516f, vint);
+    octant = (octant + 1) & ~1;
 
-                    break;
-                }
+    const vfloat y {__builtin_convertvector(octant, vfloat)};
+    r = ((x - y * 0.78515625f) - y * 2.4187564849853515625e-4f) - y * 3.77489497744594108e-8f;
+}
 
-                case '.':
-                    if (isdigit(data[i+1])) {
-                        t.type = tokenType::f32;
-                        c = data[++i];
-                        std::string floatStr {'.'};
+static inline vfloat vsinpoly(vfloat x, vfloat z) {
+    return ((-1.9515295891e-4f * z + 8.3321608736e-3f) * z - 1.6666654611e-1f) * z * x + x;
+}
 
-                        while (isdigit(c) || c == '_' || c == '.') {
-                            if (c == '_') {
-                                c = data[++i];
-                                continue;
-                            }
-                            else if (c == '.') {
-                                if (t.type == tokenType::f32) {
-                                    std::cerr << "Redefinition of float: " << t.toString() << '\n';
-                                    exit(1);
-                                }
-                                else {
-                                    t.type = tokenType::f32;
-                                    floatStr += '.';
-                                }
-                            }
-                            else {
-                                floatStr += c;
-                            }
+static inline vfloat vcospoly(vfloat z) {
+    return ((2.443315711809948e-5f * z - 1.388731625493765e-3f) * z + 4.166664568298827e-2f) * z * z - 0.5f * z + 1.0f;
+}
 
-                            c = data[++i];
-                        }
+/* Max 2 ULP on [-8192, 8192], or 1e-9 absolute where the result is within 1e-3 of zero. */
+static inline vfloat vsin(vfloat x) {
+    vint sign {(vint)x & (int32_t)0x80000000};
+    x = vabs(x);
 
-                        if (t.type == tokenType::f32) {
-                            t.fltData = std::stof(floatStr);
-                        }
-                        else {
-                            t.intData = std::stoi(floatStr);
-                        }
+    vfloat r;
+    vint octant;
+    vreduce(x, r, octant);
 
-                        --i; // Let for loop skip last char.
-                    }
-                    else {
-                        std::cerr << "Unexpected: '.'\n";
-                        exit(1);
-                    }
-                    break;
+    sign ^= (octant & 4) << 29;
+    const vfloat z {r * r};
+    const vint useCos {(octant & 2) != 0};
+    return (vfloat)((vint)vselect(useCos, vcospoly(z), vsinpoly(r, z)) ^ sign);
+}
 
-                default:
-                    std::cerr << "Unexpected: " << c << '\n';
-                    exit(1);
-            }
+/* Max 2 ULP on [-8192, 8192], or 1e-9 absolute where the result is within 1e-3 of zero. */
+static inline vfloat vcos(vfloat x) {
+    x = vabs(x);
 
-            formatTokens.push_back(t);
-        }
-    }
+    vfloat r;
+    vint octant;
+    vreduce(x, r, octant);
 
-private:
-    std::string data {};
-    std::vector<token> formatTokens {};
-};
+    const vint sign {((octant + 2) & 4) << 29};
+    const vfloat z {r * r};
+    const vint useSin {(octant & 2) != 0};
+    return (vfloat)((vint)vselect(useSin, vsinpoly(r, z), vcospoly(z)) ^ sign);
+}
 
-std::deque<token> shuntingYard(std::vector<token> &tokens) {
-    std::deque<token> queue;
-    std::vector<token> stack;
+/* Max 4 ULP; atan2(0, 0) is 0. */
+static inline vfloat vatan2(vfloat y, vfloat x) {
+    const vfloat ay {vabs(y)}, ax {vabs(x)};
+    vfloat t {ay / ax};
 
-    for (const auto &t: tokens) {
-        switch(t.type) {
-            case tokenType::i32:
-            case tokenType::f32:
-                queue.push_back(t);
-                break;
+    /* Reduce to |t| <= tan(pi/8) with atan(t) = pi/2 + atan(-1/t) or pi/4 + atan((t-1)/(t+1)). */
+    const vint big {t > 2.414213562373095f};
+    const vint mid {(t > 0.4142135623730950f) & ~big};
+    vfloat offset {vselect(big, vsplat(1.5707963267948966f), vselect(mid, vsplat(0.7853981633974483f), vsplat(0.0f)))};
+    t = vselect(big, -1.0f / t, vselect(mid, (t - 1.0f) / (t + 1.0f), t));
 
-            case tokenType::add:
-            case tokenType::sub:
-            case tokenType::mul:
-            case tokenType::div:
-            case tokenType::mod:
-            case tokenType::exp: {
-                const auto o1 {t};
+    const vfloat z {t * t};
+    vfloat a {(((8.05374449538e-2f * z - 1.38776856032e-1f) * z + 1.99777106478e-1f) * z - 3.33329491539e-1f) * z * t + t};
+    a += offset;
 
-                while(!stack.empty()) {
-                    const auto o2 = stack.back();
+    a = vselect((ay == 0.0f) & (ax == 0.0f), vsplat(0.0f), a);
+    a = vselect(x < 0.0f, 3.14159265358979f - a, a);
+    return (vfloat)((vint)a | ((vint)y & (int32_t)0x80000000));
+}
 
-                    if((! o1.rAssociative && o1.precedence <= o2.precedence)
-                       || (o1.rAssociative && o1.precedence <  o2.precedence)) {
-                        stack.pop_back();
-                        queue.push_back(o2);
-                        continue;
-                    }
+static inline vfloat vsqrt(vfloat x) {
+#if defined(__SSE__)
+    return (vfloat)_mm_sqrt_ps((__m128)x);
+#else
+    for (size_t l {0}; l < vlanes; ++l) {
+        x[l] = std::sqrt(x[l]);
+    }
+    return x;
+#endif
+}
 
-                    break;
-                }
+/*
+ * Approximate kernels used instead of the ones above with --approx. The
+ * polynomials are minimax fits of lower degree than the Cephes ones, ^ is
+ * computed as 2^(b log2 a) instead of calling powf, and the one division left
+ * uses the hardware reciprocal estimate refined by one Newton step. Division
+ * and sqrt themselves stay exact: divps and sqrtps measured faster than
+ * their estimate-and-refine versions. The bounds are relative errors
+ * measured the same way as above.
+ */
 
-                stack.push_back(o1);
-                break;
-            }
+/* Max 2e-7; 1/0 is inf and 1/inf is 0. */
+static inline vfloat vrcp(vfloat x) {
+#if defined(__SSE__)
+    const vfloat r {(vfloat)_mm_rcp_ps((__m128)x)};
+    const vfloat refined {r * (2.0f - x * r)};
+    return vselect(refined == refined, refined, r);
+#else
+    return 1.0f / x;
+#endif
+}
 
-            case tokenType::lpa:
-                stack.push_back(t);
-                break;
+/* Max 3e-6 for y in [-126, 128); above that the result is +inf, below it 0. Integral y is exact. */
+static inline vfloat vexp2Approx(vfloat y) {
+    const vint over {y >= 128.0f};
+    const vint under {y < -126.0f};
+    const vint nan {y != y};
+    y = vselect(over | under | nan, vsplat(0.0f), y);
 
-            case tokenType::rpa: {
-                bool match {false};
+    /* Adding 1.5 * 2^23 rounds y to an integer n, which then sits in the low mantissa bits. */
+    const vfloat shifted {y + 12582912.0f};
+    const vint e {(vint)shifted - 0x4b400000};
+    const vfloat f {y - (shifted - 12582912.0f)};
+    vfloat p {(((9.5828507e-3f * f + 5.5906428e-2f) * f + 2.4024099e-1f) * f + 6.9312419e-1f) * f + 1.0f};
 
-                while (!stack.empty() && stack.back().type != tokenType::lpa) {
-                    queue.push_back(stack.back());
-                    stack.pop_back();
-                    match = true;
-                }
+    const vint half {e >> 1};
+    p *= (vfloat)((half + 127) << 23);
+    p *= (vfloat)((e - half + 127) << 23);
 
-                if (!match && stack.empty()) {
-                    std::cerr << "Right parenthesis error: " << t.toString() << '\n';
-                    return {};
-                }
+    p = vselect(over, vsplat(HUGE_VALF), p);
+    p = vselect(under, vsplat(0.0f), p);
+    return vselect(nan, vsplat(NAN), p);
+}
 
-                if (!stack.empty()) stack.pop_back();
-                break;
-            }
+/* Max 5e-7 for normal positive inputs, same special cases as vlog. */
+static inline vfloat vlog2Approx(vfloat x) {
+    const vint invalid {(x < 0.0f) | (x != x)};
+    const vint zero {x == 0.0f};
+    const vint inf {x == HUGE_VALF};
 
-            default:
-                std::cerr << "Error: " << t.toString();
-                return {};
-        }
-    }
+    const vint bits {(vint)x};
+    vint e {((bits >> 23) & 0xff) - 127};
+    vfloat m {(vfloat)((bits & 0x007fffff) | 0x3f800000)};
 
-    while(!stack.empty()) {
-        if(stack.back().type == tokenType::lpa) {
-            std::cerr << "Mismatched parentheses error\n";
-            return {};
-        }
+    /* m in [sqrt(1/2), sqrt(2)) so that t = (m - 1) / (m + 1) stays within 0.172. */
+    const vint big {m > 1.41421356f};
+    m = vselect(big, m * 0.5f, m);
+    e -= big;
 
-        queue.push_back(std::move(stack.back()));
-        stack.pop_back();
-    }
+    const vfloat t {(m - 1.0f) * vrcp(m + 1.0f)};
+    const vfloat z {t * t};
+    x = ((5.9577605e-1f * z + 9.6158850e-1f) * z + 2.8853904f) * t + __builtin_convertvector(e, vfloat);
 
-    return queue;
+    x = vselect(inf, vsplat(HUGE_VALF), x);
+    x = vselect(zero, vsplat(-HUGE_VALF), x);
+    return vselect(invalid, vsplat(NAN), x);
 }
 
-float compute(std::deque<token> &formatted) {
-    std::vector<float> stack {};
+/* Max 7e-6 on [-87.3, 88.7]. */
+static inline vfloat vexpApprox(vfloat x) {
+    return vexp2Approx(x * 1.44269504088896341f);
+}
+
+/* Max 5e-7 for normal positive inputs. */
+static inline vfloat vlogApprox(vfloat x) {
+    return vlog2Approx(x) * 0.693147180559945309f;
+}
+
+/* Max 1.5e-5 on [-8192, 8192], or 1e-9 absolute where the result is within 1e-3 of zero. */
+static inline vfloat vsinApprox(vfloat x) {
+    vint sign {(vint)x & (int32_t)0x80000000};
+    x = vabs(x);
+
+    vfloat r;
+    vint octant;
+    vreduce(x, r, octant);
+
+    sign ^= (octant & 4) << 29;
+    const vfloat z {r * r};
+    const vfloat s {(8.1632820e-3f * z - 1.6663390e-1f) * z * r + r};
+    const vfloat c {(4.0458453e-2f * z - 4.9976056e-1f) * z + 1.0f};
+    return (vfloat)((vint)vselect((octant & 2) != 0, c, s) ^ sign);
+}
+
+/* Max 1.5e-5 on [-8192, 8192], or 1e-9 absolute where the result is within 1e-3 of zero. */
+static inline vfloat vcosApprox(vfloat x) {
+    x = vabs(x);
+
+    vfloat r;
+    vint octant;
+    vreduce(x, r, octant);
+
+    const vint sign {((octant + 2) & 4) << 29};
+    const vfloat z {r * r};
+    const vfloat s {(8.1632820e-3f * z - 1.6663390e-1f) * z * r + r};
+    const vfloat c {(4.0458453e-2f * z - 4.9976056e-1f) * z + 1.0f};
+    return (vfloat)((vint)vselect((octant & 2) != 0, s, c) ^ sign);
+}
+
+/* a^b as 2^(b log2 |a|): max 1e-5 while |b log2 a| <= 128, with the sign and NaN rules of pow. */
+static inline vfloat vpowApprox(vfloat a, vfloat b) {
+    vfloat p {vexp2Approx(b * vlog2Approx(vabs(a)))};
+
+    /* From 2^24 on every float is an even integer; below it trunc is exact. */
+    const vint large {vabs(b) >= 16777216.0f};
+    const vint whole {vtrunc(b) == b};
+    const vint odd {whole & ~large & ((__builtin_convertvector(b, vint) & 1) != 0)};
+    p = (vfloat)((vint)p | ((vint)a & odd & (int32_t)0x80000000));
+    p = vselect((a < 0.0f) & ~(whole | large), vsplat(NAN), p);
+    return vselect((b == 0.0f) | (a == 1.0f), vsplat(1.0f), p);
+}
+
+/*
+ * Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2,
+ * 3"), a counter-based generator: each lane hashes its own 128 bit counter
+ * under a 64 bit key, so any sample can be generated independently of all
+ * others. That is what makes Monte Carlo results independent of how the
+ * samples are split across threads.
+ */
+typedef uint32_t vuint __attribute__((vector_size(16)));
+typedef uint64_t vulong __attribute__((vector_size(32)));
+
+static inline void vphilox(vuint c[4], vuint k0, vuint k1) {
+    for (int round {0}; round < 10; ++round) {
+        const vulong p0 {__builtin_convertvector(c[0], vulong) * 0xd2511f53u};
+        const vulong p1 {__builtin_convertvector(c[2], vulong) * 0xcd9e8d57u};
+        const vuint hi0 {__builtin_convertvector(p0 >> 32, vuint)};
+        const vuint hi1 {__builtin_convertvector(p1 >> 32, vuint)};
+
+        c[0] = hi1 ^ c[1] ^ k0;
+        c[1] = __builtin_convertvector(p1, vuint);
+        c[2] = hi0 ^ c[3] ^ k1;
+        c[3] = __builtin_convertvector(p0, vuint);
+        k0 += 0x9e3779b9u;
+        k1 += 0xbb67ae85u;
+    }
+}
+
+/* Uniform on (0, 1), never exactly 0 so that log is finite. */
+static inline vfloat vunit(vuint x) {
+    return __builtin_convertvector((vint)(x >> 8), vfloat) * 5.9604644775390625e-8f + 2.98023223876953125e-8f;
+}
+
+/* Samples in a group of one Philox call per lane; group g of draw d covers samples 16g to 16g + 15. */
+constexpr size_t sampleGroup {4 * vlanes};
+
+/*
+ * Fills out with samples first to first + n of random draw number draw:
+ * uniform on (0, 1), or standard normal through Box-Muller. first must be a
+ * multiple of sampleGroup; n is rounded up to one.
+ */
+static void fillSamples(float *out, uint64_t seed, uint64_t draw, uint64_t first, size_t n, bool normal) {
+    const vuint k0 {vuint {} + (uint32_t)seed}, k1 {vuint {} + (uint32_t)(seed >> 32)};
+
+    for (size_t g {0}; g < n; g += sampleGroup) {
+        const uint64_t block {(first + g) / vlanes};
+        vuint c[4] {vuint {0, 1, 2, 3} + (uint32_t)block, vuint {} + (uint32_t)(block >> 32),
+                    vuint {} + (uint32_t)draw, vuint {} + (uint32_t)(draw >> 32)};
+        vphilox(c, k0, k1);
+
+        vfloat s[4] {vunit(c[0]), vunit(c[1]), vunit(c[2]), vunit(c[3])};
+        if (normal) {
+            for (size_t w {0}; w < 2; ++w) {
+                const vfloat r {vsqrt(-2.0f * vlog(s[w]))};
+                const vfloat theta {6.28318530717958648f * s[w + 2]};
+                s[w] = r * vcos(theta);
+                s[w + 2] = r * vsin(theta);
+            }
+        }
+
+        std::memcpy(out + g, s, sizeof s);
+    }
+}
+
+/* Scalar uniform(a, b) and normal(mu, sigma) draw from one stream per thread and kind: seed 0, samples in order. */
+static float drawSample(bool normal) {
+    thread_local float samples[2][sampleGroup];
+    thread_local uint64_t next[2] {};
+
+    if (next[normal] % sampleGroup == 0) {
+        fillSamples(samples[normal], 0, normal, next[normal], sampleGroup, normal);
+    }
+
+    return samples[normal][next[normal]++ % sampleGroup];
+}
+
+/* Applies a unary kernel in place over n floats (n must be a multiple of vlanes). */
+template <vfloat (*kernel)(vfloat)>
+static void batchUnary(float *a, const float *, size_t n) {
+    for (size_t k {0}; k < n; k += vlanes) {
+        vfloat x;
+        std::memcpy(&x, a + k, sizeof x);
+        x = kernel(x);
+        std::memcpy(a + k, &x, sizeof x);
+    }
+}
+
+static void batchMin(float *a, const float *b, size_t n) {
+    for (size_t k {0}; k < n; ++k) {
+        a[k] = b[k] < a[k] ? b[k] : a[k];
+    }
+}
+
+static void batchMax(float *a, const float *b, size_t n) {
+    for (size_t k {0}; k < n; ++k) {
+        a[k] = b[k] > a[k] ? b[k] : a[k];
+    }
+}
+
+/* Branchless ?: for batch mode: both branches are already computed, each lane keeps one through a mask and blend. */
+static void batchSelect(float *cond, const float *then, const float *otherwise, size_t n) {
+    for (size_t k {0}; k < n; k += vlanes) {
+        vfloat c, a, b;
+        std::memcpy(&c, cond + k, sizeof c);
+        std::memcpy(&a, then + k, sizeof a);
+        std::memcpy(&b, otherwise + k, sizeof b);
+        c = vselect(c != 0.0f, a, b);
+        std::memcpy(cond + k, &c, sizeof c);
+    }
+}
+
+/* ^ with --approx. */
+static void batchPowApprox(float *a, const float *b, size_t n) {
+    for (size_t k {0}; k < n; k += vlanes) {
+        vfloat x, y;
+        std::memcpy(&x, a + k, sizeof x);
+        std::memcpy(&y, b + k, sizeof y);
+        x = vpowApprox(x, y);
+        std::memcpy(a + k, &x, sizeof x);
+    }
+}
+
+/*
+ * Random variables in batch mode. Their third argument is the tile of
+ * samples of that draw, which prepareDraws appends; see fillSamples.
+ */
+static void batchUniform(float *a, const float *b, size_t n) {
+    for (size_t k {0}; k < n; ++k) {
+        a[k] += (b[k] - a[k]) * b[n + k];
+    }
+}
+
+static void batchNormal(float *a, const float *b, size_t n) {
+    for (size_t k {0}; k < n; ++k) {
+        a[k] += b[k] * b[n + k];
+    }
+}
+
+/*
+ * Built-in functions: scalar mode calls libm, batch mode calls the kernels
+ * above in place on the first argument. approx replaces batch with --approx;
+ * it is null where batch is already exact.
+ */
+class builtin {
+public:
+    const char *name;
+    size_t arity;
+    float (*scalar)(const float *args);
+    void (*batch)(float *a, const float *b, size_t n);
+    void (*approx)(float *a, const float *b, size_t n);
+    bool random {}; // Draws a new value on every evaluation, so it is never folded.
+};
+
+static const builtin builtins[] {
+    {"sqrt",  1, [](const float *a) { return std::sqrt(a[0]); },          batchUnary<vsqrt>,  nullptr},
+    {"abs",   1, [](const float *a) { return std::fabs(a[0]); },          batchUnary<vabs>,   nullptr},
+    {"exp",   1, [](const float *a) { return std::exp(a[0]); },           batchUnary<vexp>,   batchUnary<vexpApprox>},
+    {"log",   1, [](const float *a) { return std::log(a[0]); },           batchUnary<vlog>,   batchUnary<vlogApprox>},
+    {"sin",   1, [](const float *a) { return std::sin(a[0]); },           batchUnary<vsin>,   batchUnary<vsinApprox>},
+    {"cos",   1, [](const float *a) { return std::cos(a[0]); },           batchUnary<vcos>,   batchUnary<vcosApprox>},
+    {"min",   2, [](const float *a) { return std::min(a[0], a[1]); },     batchMin,           nullptr},
+    {"max",   2, [](const float *a) { return std::max(a[0], a[1]); },     batchMax,           nullptr},
+    {"floor", 1, [](const float *a) { return std::floor(a[0]); },         batchUnary<vfloor>, nullptr},
+    {"uniform", 2, [](const float *a) { return a[0] + (a[1] - a[0]) * drawSample(false); }, batchUniform, nullptr, true},
+    {"normal",  2, [](const float *a) { return a[0] + a[1] * drawSample(true); },            batchNormal,  nullptr, true},
+};
+
+/* Indices into builtins, for the evaluation modes that implement them without scalar or batch. */
+enum class builtinSlot : size_t {
+    sqrt, abs, exp, log, sin, cos, min, max, floor, uniform, normal
+};
+
+/* FNV-1a, 64 bit. The lexer computes it while scanning an identifier. */
+constexpr uint64_t fnvOffset {14695981039346656037ull};
+constexpr uint64_t fnvPrime {1099511628211ull};
+
+static inline uint64_t fnv1a(const std::string &name) {
+    uint64_t hash {fnvOffset};
+    for (const char c: name) {
+        hash = (hash ^ (unsigned char)c) * fnvPrime;
+    }
+
+    return hash;
+}
+
+/* Final mix of MurmurHash3, so that bucket and slot use all bits of the FNV hash. */
+static inline uint64_t mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
+}
+
+/*
+ * Minimal perfect hash from the name hashes of a set of symbols to their
+ * indices, built by hash-and-displace: the keys are spread over buckets, and
+ * each bucket, largest first, gets the first displacement that sends all its
+ * keys to free slots. A lookup reads one displacement and one slot and
+ * compares 64 bit hashes, never strings.
+ */
+class perfectHash {
+public:
+    /* Maps hashes[i] to i. Two names with the same 64 bit hash make it fail with evalError, which the expression that added the second reports. */
+    void build(const std::vector<uint64_t> &hashes) {
+        const size_t n {hashes.size()};
+        const size_t buckets {std::max<size_t>(1, (n + 3) / 4)};
+
+        std::vector<std::vector<uint32_t>> members(buckets);
+        for (size_t i {0}; i < n; ++i) {
+            members[mix64(hashes[i]) % buckets].push_back((uint32_t)i);
+        }
+
+        std::vector<size_t> order(buckets);
+        for (size_t b {0}; b < buckets; ++b) order[b] = b;
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return members[a].size() > members[b].size(); });
+
+        displacements.assign(buckets, 0);
+        keys.assign(n, 0);
+        indices.assign(n, 0);
+        std::vector<bool> taken(n, false);
+        std::vector<size_t> slots {};
+
+        for (const size_t b: order) {
+            for (uint32_t d {0}; !members[b].empty(); ++d) {
+                slots.clear();
+                for (const uint32_t i: members[b]) {
+                    const size_t s {slot(hashes[i], d)};
+                    if (taken[s] || std::find(slots.begin(), slots.end(), s) != slots.end()) break;
+                    slots.push_back(s);
+                }
+
+                if (slots.size() == members[b].size()) {
+                    displacements[b] = d;
+                    for (size_t k {0}; k < slots.size(); ++k) {
+                        taken[slots[k]] = true;
+                        keys[slots[k]] = hashes[members[b][k]];
+                        indices[slots[k]] = members[b][k];
+                    }
+                    break;
+                }
+
+                /* Only keys with equal hashes can make every displacement fail. */
+                if (d == 1u << 20) {
+                    fail("Symbol hash collision");
+                }
+            }
+        }
+    }
+
+    /* Index of the symbol with this name hash, or -1. */
+    [[nodiscard]] long find(uint64_t hash) const {
+        if (keys.empty()) {
+            return -1;
+        }
+
+        const size_t s {slot(hash, displacements[mix64(hash) % displacements.size()])};
+        return keys[s] == hash ? (long)indices[s] : -1;
+    }
+
+private:
+    [[nodiscard]] size_t slot(uint64_t hash, uint32_t displacement) const {
+        return mix64(hash + displacement * 0x9e3779b97f4a7c15ull) % keys.size();
+    }
+
+    std::vector<uint32_t> displacements {};
+    std::vector<uint64_t> keys {};
+    std::vector<uint32_t> indices {};
+};
+
+/* Returns the index into builtins, or -1 if there is no builtin with that name hash. */
+long findBuiltin(uint64_t hash) {
+    static const perfectHash index {[] {
+        std::vector<uint64_t> hashes {};
+        for (const builtin &b: builtins) hashes.push_back(fnv1a(b.name));
+
+        perfectHash table {};
+        table.build(hashes);
+        return table;
+    }()};
+
+    return index.find(hash);
+}
+
+long findBuiltin(const std::string &name) {
+    return findBuiltin(fnv1a(name));
+}
+
+/*
+ * Special forms look like calls but bind a variable in one of their
+ * arguments, such as integrate(x^2, x, 0, 1). lowerForms compiles that
+ * argument into a subprogram held by the form token and leaves the others
+ * as ordinary operands.
+ */
+class specialForm {
+public:
+    const char *name;
+    size_t arity;
+    size_t body;     // Argument index of the expression.
+    size_t variable; // Argument index of the variable it binds.
+};
+
+static const specialForm forms[] {
+    {"integrate", 4, 0, 1},
+    {"sum",       4, 3, 0},
+    {"prod",      4, 3, 0},
+    {"solve",     4, 0, 1},
+};
+
+/* Indices into forms, for evaluateForm. */
+enum class formSlot : size_t {
+    integrate, sum, prod, solve
+};
+
+/* Returns the index into forms, or -1 if there is no form with that name hash. */
+long findForm(uint64_t hash) {
+    static const perfectHash index {[] {
+        std::vector<uint64_t> hashes {};
+        for (const specialForm &f: forms) hashes.push_back(fnv1a(f.name));
+
+        perfectHash table {};
+        table.build(hashes);
+        return table;
+    }()};
+
+    return index.find(hash);
+}
+
+/* A function defined at runtime, such as f(x, y) = x^2 + y. Its body refers to parameter n through an arg token with slot n. */
+class userFunction {
+public:
+    std::string name {};
+    std::vector<std::string> params {};
+    std::deque<token> body {};
+};
+
+/*
+ * Bignum mode: exact integers of any size. Values that fit stay an inline
+ * int64 and take the hardware fast path; an operation that overflows
+ * promotes its result to heap limbs (base 2^32, least significant first),
+ * and results that fit again are demoted back.
+ */
+class bigint {
+public:
+    bigint(int64_t value = 0) : small {value} {}
+
+    [[nodiscard]] bool isSmall() const {
+        return limbs.empty();
+    }
+
+    int64_t small {};
+    bool negative {};                // Sign of a promoted value.
+    std::vector<uint32_t> limbs {};  // Magnitude of a promoted value.
+};
+
+/* How the REPL evaluates programs: float compute, one of the exact computeDecimal and computeBig, or computeComplex. */
+enum class evalMode {
+    real,
+    decimal,
+    bignum,
+    complex
+};
+
+class sharedCache;
+class snapshot;
+
+/* A compiled program and, if it differs, the form the scalar evaluators run: lowered, and fused in float mode; see makeCachedProgram. */
+class cachedProgram {
+public:
+    [[nodiscard]] const std::deque<token> &scalar() const {
+        return lowered.empty() ? compiled : lowered;
+    }
+
+    std::deque<token> compiled {};
+    std::deque<token> lowered {};
+    std::vector<size_t> reads {}; // Variable slots the program reads, which must have values when it runs.
+};
+
+/* Compiled programs by expression text and by canonical key; see compileCached. */
+class programCache {
+public:
+    void clear() {
+        byText.clear();
+        byKey.clear();
+    }
+
+    std::unordered_map<std::string, std::shared_ptr<const cachedProgram>> byText {};
+    std::unordered_map<std::string, std::shared_ptr<const cachedProgram>> byKey {};
+    sharedCache *shared {}; // The cache of --shm-cache, consulted on a byKey miss.
+    const snapshot *restored {}; // The snapshot of --snapshot, consulted on a miss of either map while it matches the functions.
+};
+
+/* State that outlives a single expression: variables, their values and user-defined functions. */
+class environment {
+public:
+    /*
+     * Slot of the variable with this name and name hash, creating it if
+     * needed. Variables the perfect hash does not cover yet are found in
+     * recentVariables until indexVariables folds them in.
+     */
+    size_t intern(const std::string &name, uint64_t hash) {
+        if (const long slot {variableIndex.find(hash)}; slot >= 0) {
+            return (size_t)slot;
+        }
+
+        if (const auto recent {recentVariables.find(hash)}; recent != recentVariables.end()) {
+            return recent->second;
+        }
+
+        variables.push_back(name);
+        variableHashes.push_back(hash);
+        recentVariables.emplace(hash, variables.size() - 1);
+        return variables.size() - 1;
+    }
+
+    size_t intern(const std::string &name) {
+        const size_t slot {intern(name, fnv1a(name))};
+        indexVariables();
+        return slot;
+    }
+
+    /*
+     * Rebuilds the perfect hash over all variables once those created since
+     * the last rebuild outnumber the ones it covers, so that defining n
+     * variables one at a time rebuilds it O(log n) times.
+     */
+    void indexVariables() {
+        if (recentVariables.size() > indexedVariables) {
+            variableIndex.build(variableHashes);
+            indexedVariables = variableHashes.size();
+            recentVariables.clear();
+        }
+    }
+
+    /* Returns the index into functions, or -1 if no function with that name hash was defined. */
+    [[nodiscard]] long findFunction(uint64_t hash) const {
+        if (const long index {functionIndex.find(hash)}; index >= 0) {
+            return index;
+        }
+
+        const auto recent {recentFunctions.find(hash)};
+        return recent != recentFunctions.end() ? (long)recent->second : -1;
+    }
+
+    [[nodiscard]] long findFunction(const std::string &name) const {
+        return findFunction(fnv1a(name));
+    }
+
+    /* Adds f, or replaces the function of the same name. Compiled programs may have inlined the old one. */
+    void define(const userFunction &f) {
+        const uint64_t hash {fnv1a(f.name)};
+        programs.clear();
+        programs.restored = nullptr;
+
+        if (const long existing {findFunction(hash)}; existing >= 0) {
+            functions[(size_t)existing] = f;
+            return;
+        }
+
+        functions.push_back(f);
+        functionHashes.push_back(hash);
+        recentFunctions.emplace(hash, functions.size() - 1);
+
+        /* As in indexVariables. */
+        if (recentFunctions.size() > indexedFunctions) {
+            functionIndex.build(functionHashes);
+            indexedFunctions = functionHashes.size();
+            recentFunctions.clear();
+        }
+    }
+
+    void assign(size_t slot, float value) {
+        if (slot >= values.size()) {
+            values.resize(slot + 1, NAN);
+        }
+
+        values[slot] = value;
+        markAssigned(slot);
+    }
+
+    /*
+     * Whether the variable in slot was given a value. The value vectors are
+     * padded up to the highest slot assigned, so their size does not tell;
+     * and NaN is a float value like any other.
+     */
+    [[nodiscard]] bool hasValue(size_t slot) const {
+        return slot < assigned.size() && assigned[slot];
+    }
+
+    void assign(size_t slot, int64_t value) {
+        if (slot >= units.size()) {
+            units.resize(slot + 1, 0);
+        }
+
+        units[slot] = value;
+        markAssigned(slot);
+    }
+
+    void assign(size_t slot, std::complex<float> value) {
+        if (slot >= complexes.size()) {
+            complexes.resize(slot + 1);
+        }
+
+        complexes[slot] = value;
+        markAssigned(slot);
+    }
+
+    void assign(size_t slot, const bigint &value) {
+        if (slot >= integers.size()) {
+            integers.resize(slot + 1);
+        }
+
+        integers[slot] = value;
+        markAssigned(slot);
+    }
+
+    std::vector<std::string> variables {};
+    std::vector<float> values {};
+    std::vector<userFunction> functions {};
+    evalMode mode {evalMode::real};
+    int scale {};                  // Fraction digits in the decimal mode.
+    std::vector<int64_t> units {}; // Variable values in the decimal mode, in units of 10^-scale.
+    std::vector<bigint> integers {}; // Variable values in the bignum mode.
+    std::vector<std::complex<float>> complexes {}; // Variable values in the complex mode.
+    bool approx {};                // Batch and array kernels use the approximate tier (--approx).
+    programCache programs {};      // Compiled programs; they depend on mode and functions, which are set before it fills.
+
+private:
+    void markAssigned(size_t slot) {
+        if (slot >= assigned.size()) {
+            assigned.resize(slot + 1, false);
+        }
+
+        assigned[slot] = true;
+    }
+
+    std::vector<bool> assigned {}; // Slots given a value in any mode; see hasValue.
+
+    /* Name hashes of variables and functions in slot order, and the perfect hashes over them. */
+    std::vector<uint64_t> variableHashes {};
+    std::vector<uint64_t> functionHashes {};
+    perfectHash variableIndex {};
+    perfectHash functionIndex {};
+    size_t indexedVariables {}; // Variables covered by variableIndex.
+    std::unordered_map<uint64_t, size_t> recentVariables {}; // Name hash to slot of the variables after those.
+    size_t indexedFunctions {};
+    std::unordered_map<uint64_t, size_t> recentFunctions {};
+};
+
+/* The float value of a literal's digits; fails rather than throw out_of_range when it is beyond float. */
+float parseFloat(const std::string &digits) {
+    errno = 0;
+    const float value {std::strtof(digits.c_str(), nullptr)};
+
+    if (errno == ERANGE && std::isinf(value)) {
+        fail("Number too large: ", digits);
+    }
+
+    return value;
+}
+
+class lexana {
+public:
+    explicit lexana(environment &_env) : env {_env} {}
+
+    /* For debugging lexer output. */
+    [[maybe_unused]] [[nodiscard]] std::string toString() const {
+        std::string s {"[\n"};
+        for (const token &t: formatTokens) {
+            s += '\t' + t.toString() + '\n';
+        }
+        s += ']';
+        return s;
+    }
+
+    [[nodiscard]] std::vector<token> &getTokens() {
+        return formatTokens;
+    }
+
+    [[nodiscard]] environment &getEnvironment() {
+        return env;
+    }
+
+    /* Variable names in binding order; a variable's slot indexes this list. */
+    [[nodiscard]] const std::vector<std::string> &getVariables() const {
+        return env.variables;
+    }
+
+    /*
+     * Precedence, lowest first: ?: || && == != < > <= >= + - * / ^ unary- %.
+     * Names in params lex as arg tokens instead of variables, for compiling function bodies.
+     */
+    void lex(const std::string &_data, const std::vector<std::string> &_params = {}) {
+        data = _data;
+        params = &_params;
+        formatTokens.clear(); // Left over if the last expression failed.
+        size_t steps {0};
+
+        for (size_t i {0}; i < data.size(); ++i) {
+            if (++steps % cancellationInterval == 0) checkCancelled();
+            char c {data[i]};
+            token t {};
+
+            switch (c) {
+                case ' ':
+                case '\t':
+                case '\n':
+                case '\r':
+                    continue;
+
+                case '(':
+                    t.type = tokenType::lpa;
+                    t.strData = '(';
+                    t.precedence = 13;
+                    t.rAssociative = false;
+                    break;
+
+                case '[':
+                    t.type = tokenType::lbr;
+                    t.strData = '[';
+                    t.precedence = 13;
+                    t.rAssociative = false;
+                    break;
+
+                case ']':
+                    t.type = tokenType::rbr;
+                    t.strData = ']';
+                    t.precedence = 0;
+                    t.rAssociative = false;
+                    break;
+
+                case ')':
+                    t.type = tokenType::rpa;
+                    t.strData = ')';
+                    t.precedence = 0;
+                    t.rAssociative = false;
+                    break;
+
+                case '+':
+                    t.type = tokenType::add;
+                    t.strData = '+';
+                    t.precedence = 6;
+                    t.rAssociative = false;
+                    break;
+
+                case '-':
+                    if (!endsOperand()) {
+                        t.unary = true;
+                        t.precedence = 9;
+                        t.rAssociative = false;
+                        t.strData = 'm';
+                        t.precedence = 9;
+                        t.type = tokenType::sub;
+                    }
+                    else {
+                        t.type = tokenType::sub;
+                        t.strData = '-';
+                        t.precedence = 6;
+                        t.rAssociative = false;
+                    }
+                    break;
+
+                case '/':
+                    t.type = tokenType::div;
+                    t.strData = '/';
+                    t.precedence = 7;
+                    t.rAssociative = false;
+                    break;
+
+                case ',':
+                    t.type = tokenType::sep;
+                    t.strData = ',';
+                    t.precedence = 0;
+                    t.rAssociative = false;
+                    break;
+
+                case 'x':
+                    /* 'x' only means multiply where an operator is expected, otherwise it is a name. */
+                    if (!endsOperand()) {
+                        lexIdentifier(i, t);
+                        break;
+                    }
+                    [[fallthrough]];
+
+                case '*':
+                    t.type = tokenType::mul;
+                    t.strData = '*';
+                    t.precedence = 7;
+                    t.rAssociative = false;
+                    break;
+
+                case '%':
+                    t.type = tokenType::mod;
+                    t.strData = '%';
+                    t.precedence = 10;
+                    t.rAssociative = false;
+                    break;
+
+                case '^':
+                    t.type = tokenType::exp;
+                    t.strData = '^';
+                    t.precedence = 8;
+                    t.rAssociative = true;
+                    break;
+
+                case '<':
+                case '>':
+                    if (data[i + 1] == '=') {
+                        t.type = c == '<' ? tokenType::le : tokenType::ge;
+                        t.strData = std::string {c} + '=';
+                        ++i;
+                    }
+                    else {
+                        t.type = c == '<' ? tokenType::lt : tokenType::gt;
+                        t.strData = c;
+                    }
+                    t.precedence = 5;
+                    t.rAssociative = false;
+                    break;
+
+                case '=':
+                case '!':
+                    if (data[i + 1] != '=') {
+                        fail("Unexpected: ", c);
+                    }
+                    t.type = c == '=' ? tokenType::eq : tokenType::ne;
+                    t.strData = std::string {c} + '=';
+                    t.precedence = 4;
+                    t.rAssociative = false;
+                    ++i;
+                    break;
+
+                case '&':
+                case '|':
+                    if (data[i + 1] != c) {
+                        fail("Unexpected: ", c);
+                    }
+                    t.type = c == '&' ? tokenType::land : tokenType::lor;
+                    t.strData = std::string(2, c);
+                    t.precedence = c == '&' ? 3 : 2;
+                    t.rAssociative = false;
+                    ++i;
+                    break;
+
+                case '?':
+                    t.type = tokenType::qst;
+                    t.strData = '?';
+                    t.precedence = 1;
+                    t.rAssociative = true;
+                    break;
+
+                case ':':
+                    t.type = tokenType::col;
+                    t.strData = ':';
+                    t.precedence = 1;
+                    t.rAssociative = true;
+                    break;
+
+                case '0':
+                case '9':
+                case '8':
+                case '7':
+                case '6':
+                case '5':
+                case '4':
+                case '3':
+                case '2':
+                case '1': {
+                    std::string floatStr {};
+                    t.type = tokenType::i32;
+
+                    while (std::isdigit(c) || c == '_' || c == '.') {
+                        if (c == '_') {
+                            c = data[++i];
+                            continue;
+                        }
+                        else if (c == '.') {
+                            if (t.type == tokenType::f32) {
+                                fail("Redefinition of float: ", t.toString());
+                            }
+                            else {
+                                t.type = tokenType::f32;
+                                floatStr += '.';
+                            }
+                        }
+                        else {
+                            floatStr += c;
+                        }
+
+                        c = data[++i];
+                    }
+
+                    if (t.type == tokenType::i32 && floatStr.size() > 18) {
+                        t.type = tokenType::f32; // Too long for intData.
+                    }
+
+                    if (t.type == tokenType::f32) {
+                        t.fltData = parseFloat(floatStr);
+                    }
+                    else {
+                        t.intData = std::stol(floatStr);
+                    }
+                    t.strData = floatStr; // Exact text for the decimal mode.
+
+                    /* An 'i' suffix makes an imaginary literal for the complex mode. */
+                    if (c == 'i' && !std::isalnum((unsigned char)data[i + 1]) && data[i + 1] != '_') {
+                        t.type = tokenType::img;
+                        t.fltData = parseFloat(floatStr);
+                        ++i;
+                    }
+
+                    --i; // Let for loop skip last char.
+
+                    break;
+                }
+
+                case '.':
+                    if (isdigit(data[i+1])) {
+                        t.type = tokenType::f32;
+                        c = data[++i];
+                        std::string floatStr {'.'};
+
+                        while (isdigit(c) || c == '_' || c == '.') {
+                            if (c == '_') {
+                                c = data[++i];
+                                continue;
+                            }
+                            else if (c == '.') {
+                                if (t.type == tokenType::f32) {
+                                    fail("Redefinition of float: ", t.toString());
+                                }
+                                else {
+                                    t.type = tokenType::f32;
+                                    floatStr += '.';
+                                }
+                            }
+                            else {
+                                floatStr += c;
+                            }
+
+                            c = data[++i];
+                        }
+
+                        if (t.type == tokenType::i32 && floatStr.size() > 18) {
+                            t.type = tokenType::f32; // Too long for intData.
+                        }
+
+                        if (t.type == tokenType::f32) {
+                            t.fltData = parseFloat(floatStr);
+                        }
+                        else {
+                            t.intData = std::stol(floatStr);
+                        }
+                        t.strData = floatStr;
+
+                        /* An 'i' suffix makes an imaginary literal for the complex mode. */
+                        if (c == 'i' && !std::isalnum((unsigned char)data[i + 1]) && data[i + 1] != '_') {
+                            t.type = tokenType::img;
+                            t.fltData = parseFloat(floatStr);
+                            ++i;
+                        }
+
+                        --i; // Let for loop skip last char.
+                    }
+                    else {
+                        fail("Unexpected: '.'");
+                    }
+                    break;
+
+                default:
+                    if (std::isalpha((unsigned char)c)) {
+                        lexIdentifier(i, t);
+                        break;
+                    }
+
+                    fail("Unexpected: ", c);
+            }
+
+            formatTokens.push_back(t);
+        }
+
+        env.indexVariables();
+    }
+
+private:
+    [[nodiscard]] bool endsOperand() const {
+        return !formatTokens.empty() && (formatTokens.back().type == tokenType::i32
+                                         || formatTokens.back().type == tokenType::f32
+                                         || formatTokens.back().type == tokenType::var
+                                         || formatTokens.back().type == tokenType::arg
+                                         || formatTokens.back().type == tokenType::img
+                                         || formatTokens.back().type == tokenType::rbr
+                                         || formatTokens.back().type == tokenType::rpa);
+    }
+
+    /* A name followed by '(' is a function call, anything else is a variable. */
+    void lexIdentifier(size_t &i, token &t) {
+        size_t end {i};
+        uint64_t hash {fnvOffset};
+        while (std::isalnum((unsigned char)data[end]) || data[end] == '_') {
+            hash = (hash ^ (unsigned char)data[end]) * fnvPrime;
+            ++end;
+        }
+
+        t.strData = data.substr(i, end - i);
+
+        size_t next {end};
+        while (data[next] == ' ' || data[next] == '\t') {
+            ++next;
+        }
+
+        if (data[next] == '(') {
+            if (const long form {findForm(hash)}; form >= 0) {
+                t.type = tokenType::form;
+                t.slot = (size_t)form;
+            }
+            else if (const long index {findBuiltin(hash)}; index >= 0) {
+                t.type = tokenType::fun;
+                t.slot = (size_t)index;
+            }
+            else if (const long user {env.findFunction(hash)}; user >= 0) {
+                t.type = tokenType::call;
+                t.slot = (size_t)user;
+            }
+            else {
+                fail("Unknown function: ", t.strData);
+            }
+        }
+        else if (const auto param {std::find(params->begin(), params->end(), t.strData)}; param != params->end()) {
+            t.type = tokenType::arg;
+            t.slot = param - params->begin();
+        }
+        else {
+            t.type = tokenType::var;
+            t.slot = env.intern(t.strData, hash);
+        }
+
+        i = end - 1; // Let for loop skip last char.
+    }
+
+    environment &env;
+    const std::vector<std::string> *params {};
+    std::string data {};
+    std::vector<token> formatTokens {};
+};
+
+std::deque<token> shuntingYard(std::vector<token> &tokens) {
+    std::deque<token> queue;
+    std::vector<token> stack;
+    std::vector<size_t> separators; // Commas seen inside each open parenthesis.
+    tokenType previous {tokenType::nil};
+    size_t steps {0};
+
+    for (const auto &t: tokens) {
+        if (++steps % cancellationInterval == 0) checkCancelled();
+
+        switch(t.type) {
+            case tokenType::i32:
+            case tokenType::f32:
+            case tokenType::var:
+            case tokenType::arg:
+            case tokenType::img:
+                queue.push_back(t);
+                break;
+
+            case tokenType::fun:
+            case tokenType::call:
+            case tokenType::form:
+                stack.push_back(t);
+                break;
+
+            case tokenType::add:
+            case tokenType::sub:
+            case tokenType::mul:
+            case tokenType::div:
+            case tokenType::mod:
+            case tokenType::exp:
+            case tokenType::lt:
+            case tokenType::gt:
+            case tokenType::le:
+            case tokenType::ge:
+            case tokenType::eq:
+            case tokenType::ne:
+            case tokenType::land:
+            case tokenType::lor:
+            case tokenType::qst: {
+                const auto o1 {t};
+
+                while(!stack.empty()) {
+                    const auto o2 = stack.back();
+
+                    if (o2.type == tokenType::lpa || o2.type == tokenType::lbr) {
+                        break;
+                    }
+
+                    if((! o1.rAssociative && o1.precedence <= o2.precedence)
+                       || (o1.rAssociative && o1.precedence <  o2.precedence)) {
+                        stack.pop_back();
+                        queue.push_back(o2);
+                        continue;
+                    }
+
+                    break;
+                }
+
+                stack.push_back(o1);
+                break;
+            }
+
+            case tokenType::lpa:
+                stack.push_back(t);
+                separators.push_back(0);
+                break;
+
+            /* ':' closes the branch after '?' and replaces the '?' with the ternary select. */
+            case tokenType::col:
+                while (!stack.empty() && stack.back().type != tokenType::qst && stack.back().type != tokenType::lpa
+                       && stack.back().type != tokenType::lbr) {
+                    queue.push_back(stack.back());
+                    stack.pop_back();
+                }
+
+                if (stack.empty() || stack.back().type != tokenType::qst) {
+                    fail("':' without '?': ", t.toString());
+                }
+
+                stack.pop_back();
+                stack.push_back(t);
+                break;
+
+            /* '[' opens an array the way '(' opens an argument list; the lbr is output as the array constructor. */
+            case tokenType::lbr:
+                stack.push_back(t);
+                separators.push_back(0);
+                break;
+
+            case tokenType::rbr: {
+                while (!stack.empty() && stack.back().type != tokenType::lbr && stack.back().type != tokenType::lpa) {
+                    queue.push_back(stack.back());
+                    stack.pop_back();
+                }
+
+                if (stack.empty() || stack.back().type != tokenType::lbr) {
+                    fail("Mismatched brackets error");
+                }
+
+                token array {stack.back()};
+                stack.pop_back();
+
+                array.argc = previous == tokenType::lbr ? 0 : separators.back() + 1;
+                separators.pop_back();
+
+                if (array.argc == 0) {
+                    fail("Empty array");
+                }
+
+                queue.push_back(array);
+                break;
+            }
+
+            case tokenType::sep:
+                while (!stack.empty() && stack.back().type != tokenType::lpa && stack.back().type != tokenType::lbr) {
+                    queue.push_back(stack.back());
+                    stack.pop_back();
+                }
+
+                if (!stack.empty() && stack.back().type == tokenType::lbr) {
+                    ++separators.back();
+                    break;
+                }
+
+                if (stack.size() < 2 || (stack[stack.size() - 2].type != tokenType::fun
+                                         && stack[stack.size() - 2].type != tokenType::call
+                                         && stack[stack.size() - 2].type != tokenType::form)) {
+                    fail("Separator outside of function call: ", t.toString());
+                }
+
+                ++separators.back();
+                break;
+
+            case tokenType::rpa: {
+                bool match {false};
+
+                while (!stack.empty() && stack.back().type != tokenType::lpa && stack.back().type != tokenType::lbr) {
+                    queue.push_back(stack.back());
+                    stack.pop_back();
+                    match = true;
+                }
+
+                if (!stack.empty() && stack.back().type == tokenType::lbr) {
+                    fail("Mismatched brackets error");
+                }
+
+                if (!match && stack.empty()) {
+                    fail("Right parenthesis error: ", t.toString());
+                }
+
+                if (!stack.empty()) stack.pop_back();
+
+                const size_t commas {separators.empty() ? 0 : separators.back()};
+                if (!separators.empty()) separators.pop_back();
+
+                if (!stack.empty() && (stack.back().type == tokenType::fun || stack.back().type == tokenType::call
+                                       || stack.back().type == tokenType::form)) {
+                    token f {stack.back()};
+                    stack.pop_back();
+
+                    f.argc = previous == tokenType::lpa ? 0 : commas + 1;
+
+                    /* User function arity is checked when the call is inlined. */
+                    if (f.type == tokenType::fun && f.argc != builtins[f.slot].arity) {
+                        fail(f.strData, " takes ", builtins[f.slot].arity, " argument(s), got ", f.argc);
+                    }
+
+                    if (f.type == tokenType::form && f.argc != forms[f.slot].arity) {
+                        fail(f.strData, " takes ", forms[f.slot].arity, " argument(s), got ", f.argc);
+                    }
+
+                    queue.push_back(f);
+                }
+                break;
+            }
+
+            default:
+                fail("Error: ", t.toString());
+        }
+
+        previous = t.type;
+    }
+
+    while(!stack.empty()) {
+        if(stack.back().type == tokenType::lpa || stack.back().type == tokenType::lbr) {
+            fail("Mismatched parentheses error");
+        }
+
+        queue.push_back(std::move(stack.back()));
+        stack.pop_back();
+    }
+
+    for (const token &t: queue) {
+        if (t.type == tokenType::qst) {
+            fail("'?' without ':'");
+        }
+    }
+
+    return queue;
+}
+
+float evaluateForm(const token &t, const float *operands, std::vector<float> bindings);
+
+/* a * b + c, rounded once where the target has FMA; elsewhere a software fma would cost more than it saves. */
+inline float multiplyAdd(float a, float b, float c) {
+#if defined(__FMA__)
+    return std::fma(a, b, c);
+#else
+    return a * b + c;
+#endif
+}
+
+float compute(const std::deque<token> &formatted, const std::vector<float> &bindings = {}) {
+    std::vector<float> stack {};
+
+    for (size_t pc {0}; pc < formatted.size(); ++pc) {
+        if (pc % cancellationInterval == 0) checkCancelled();
+        const token &t {formatted[pc]};
+        switch (t.type) {
+            case tokenType::nil: break;
+
+            case tokenType::i32:
+                stack.push_back((float)t.intData);
+                break;
+
+            case tokenType::f32:
+                stack.push_back(t.fltData);
+                break;
+
+            case tokenType::var:
+                if (t.slot >= bindings.size()) {
+                    fail("Unbound variable: ", t.strData);
+                }
+
+                stack.push_back(bindings[t.slot]);
+                break;
+
+            case tokenType::fun: {
+                float args[2] {};
+                for (size_t a {t.argc}; a > 0; --a) {
+                    args[a - 1] = stack.back();
+                    stack.pop_back();
+                }
+
+                stack.push_back(builtins[t.slot].scalar(args));
+                break;
+            }
+
+            case tokenType::form: {
+                const float result {evaluateForm(t, stack.data() + stack.size() - t.argc, bindings)};
+                stack.resize(stack.size() - t.argc);
+                stack.push_back(result);
+                break;
+            }
+
+            case tokenType::jz: {
+                const float cond {stack.back()};
+                stack.pop_back();
+
+                if (cond == 0.0f) {
+                    pc += t.intData;
+                }
+                break;
+            }
+
+            case tokenType::jmp:
+                pc += t.intData;
+                break;
+
+            /* Only reached by programs that were not run through lowerBranches, so both branches were evaluated. */
+            case tokenType::col: {
+                const float otherwise {stack.back()};
+                stack.pop_back();
+                const float then {stack.back()};
+                stack.pop_back();
+
+                stack.back() = stack.back() != 0.0f ? then : otherwise;
+                break;
+            }
+
+            case tokenType::addk: stack.back() += t.fltData; break;
+            case tokenType::subk: stack.back() -= t.fltData; break;
+            case tokenType::mulk: stack.back() *= t.fltData; break;
+            case tokenType::divk: stack.back() /= t.fltData; break;
+
+            case tokenType::addv:
+            case tokenType::subv:
+            case tokenType::mulv:
+            case tokenType::divv: {
+                if (t.slot >= bindings.size()) {
+                    fail("Unbound variable: ", t.strData);
+                }
+
+                const float rhs {bindings[t.slot]};
+                float &lhs {stack.back()};
+                lhs = t.type == tokenType::addv ? lhs + rhs : t.type == tokenType::subv ? lhs - rhs
+                    : t.type == tokenType::mulv ? lhs * rhs : lhs / rhs;
+                break;
+            }
+
+            case tokenType::fma: {
+                const float b {stack.back()};
+                stack.pop_back();
+                const float a {stack.back()};
+                stack.pop_back();
+
+                stack.back() = multiplyAdd(a, b, stack.back());
+                break;
+            }
+
+            case tokenType::fmak:
+            case tokenType::fmav: {
+                if (t.type == tokenType::fmav && t.slot >= bindings.size()) {
+                    fail("Unbound variable: ", t.strData);
+                }
+
+                const float b {stack.back()};
+                stack.pop_back();
+
+                stack.back() = multiplyAdd(stack.back(), b, t.type == tokenType::fmak ? t.fltData : bindings[t.slot]);
+                break;
+            }
+
+            case tokenType::add:
+            case tokenType::sub:
+            case tokenType::mul:
+            case tokenType::div:
+            case tokenType::mod:
+            case tokenType::exp:
+            case tokenType::lt:
+            case tokenType::gt:
+            case tokenType::le:
+            case tokenType::ge:
+            case tokenType::eq:
+            case tokenType::ne:
+            case tokenType::land:
+            case tokenType::lor:
+                if (t.unary) {
+                    float &rhs {stack.back()};
+                    rhs *= -1;
+                }
+                else {
+                    const float rhs {stack.back()};
+                    stack.pop_back();
+                    const float lhs {stack.back()};
+                    stack.pop_back();
+
+                    switch (t.type) {
+                        case tokenType::exp:
+                            stack.push_back(std::pow(lhs, rhs));
+                            break;
+
+                        case tokenType::mul:
+                            stack.push_back(lhs * rhs);
+                            break;
+
+                        case tokenType::div:
+                            stack.push_back(lhs / rhs);
+                            break;
+
+                        case tokenType::mod:
+                            stack.push_back(std::fmod(lhs, rhs));
+                            break;
+
+                        case tokenType::add:
+                            stack.push_back(lhs + rhs);
+                            break;
+
+                        case tokenType::sub:
+                            stack.push_back(lhs - rhs);
+                            break;
+
+                        case tokenType::lt:
+                            stack.push_back(lhs < rhs);
+                            break;
+
+                        case tokenType::gt:
+                            stack.push_back(lhs > rhs);
+                            break;
+
+                        case tokenType::le:
+                            stack.push_back(lhs <= rhs);
+                            break;
+
+                        case tokenType::ge:
+                            stack.push_back(lhs >= rhs);
+                            break;
+
+                        case tokenType::eq:
+                            stack.push_back(lhs == rhs);
+                            break;
+
+                        case tokenType::ne:
+                            stack.push_back(lhs != rhs);
+                            break;
+
+                        case tokenType::land:
+                            stack.push_back(lhs != 0.0f && rhs != 0.0f);
+                            break;
+
+                        case tokenType::lor:
+                            stack.push_back(lhs != 0.0f || rhs != 0.0f);
+                            break;
+
+                        default: break;
+                    }
+                }
+                break;
+
+            default: break;
+        }
+    }
+
+    return stack.back();
+}
+
+/*
+ * Decimal mode: exact fixed point arithmetic for money. A value v is held as
+ * the int64 v * 10^scale, so + - and % are exact and * / round once, half to
+ * even. Anything that would leave the int64 range is an error instead of a
+ * silently wrong result.
+ */
+constexpr int maxScale {18};
+
+int64_t pow10(int scale) {
+    int64_t p {1};
+    for (int i {0}; i < scale; ++i) p *= 10;
+    return p;
+}
+
+[[noreturn]] void decimalOverflow() {
+    fail("Decimal overflow");
+}
+
+/* n / d rounded half to even, in Int; d is never its minimum. */
+template <typename Int>
+Int roundedQuotient(Int n, Int d) {
+    Int q {n / d};
+    const Int r {n % d < 0 ? -(n % d) : n % d};
+    const Int divisor {d < 0 ? -d : d};
+
+    if (r > divisor - r || (r == divisor - r && q % 2 != 0)) {
+        q += (n < 0) == (d < 0) ? 1 : -1;
+    }
+
+    return q;
+}
+
+/* n / d rounded half to even; fails if that is out of int64_t. */
+int64_t roundedDiv(__int128 n, __int128 d) {
+    const __int128 q {roundedQuotient(n, d)};
+
+    if (q > INT64_MAX || q < INT64_MIN) {
+        decimalOverflow();
+    }
+
+    return (int64_t)q;
+}
+
+/* Parses the literal's exact text, rounding extra fraction digits half to even; compileParsed calls it once per literal. */
+int64_t decimalLiteral(const token &t, int scale) {
+    if (t.strData.empty()) {
+        fail("Decimal mode needs literal text: ", t.toString());
+    }
+
+    const size_t point {t.strData.find('.')};
+    const std::string whole {t.strData.substr(0, point)};
+    std::string fraction {point == std::string::npos ? "" : t.strData.substr(point + 1)};
+
+    /* Digits past scale + 1 only matter as a sticky bit that breaks a tie. */
+    if ((int)fraction.size() > scale + 1) {
+        const bool sticky {fraction.find_first_not_of('0', scale + 1) != std::string::npos};
+        fraction = fraction.substr(0, scale + 1) + (sticky ? "1" : "");
+    }
+
+    __int128 units {0};
+    for (const char c: whole + fraction) {
+        units = units * 10 + (c - '0');
+
+        if (units > ((__int128)INT64_MAX) * 1000) {
+            decimalOverflow();
+        }
+    }
+
+    const int digits {(int)fraction.size()};
+    if (digits <= scale) {
+        units *= pow10(scale - digits);
+
+        if (units > INT64_MAX) {
+            decimalOverflow();
+        }
+
+        return (int64_t)units;
+    }
+
+    return roundedDiv(units, pow10(digits - scale));
+}
+
+int64_t decimalMul(int64_t lhs, int64_t rhs, int64_t one) {
+    int64_t product {};
+    if (!__builtin_mul_overflow(lhs, rhs, &product)) {
+        return roundedQuotient(product, one);
+    }
+
+    return roundedDiv((__int128)lhs * rhs, one);
+}
+
+int64_t decimalDiv(int64_t lhs, int64_t rhs, int64_t one) {
+    if (rhs == 0) {
+        fail("Division by zero");
+    }
+
+    return roundedDiv((__int128)lhs * one, rhs);
+}
+
+/* Integer powers only, by repeated squaring; every multiplication rounds half to even. */
+int64_t decimalPow(int64_t base, int64_t exponent, int64_t one) {
+    if (exponent % one != 0) {
+        fail("Decimal mode only supports integer exponents");
+    }
+
+    const int64_t power {exponent / one};
+    const bool invert {power < 0};
+    uint64_t n {invert ? 0 - (uint64_t)power : (uint64_t)power};
+
+    int64_t result {one};
+    while (n > 0) {
+        if (n & 1) result = decimalMul(result, base, one);
+        n >>= 1;
+        if (n > 0) base = decimalMul(base, base, one);
+    }
+
+    return invert ? decimalDiv(one, result, one) : result;
+}
+
+int64_t computeDecimal(const std::deque<token> &formatted, int scale, const std::vector<int64_t> &bindings = {}) {
+    const int64_t one {pow10(scale)};
+    std::vector<int64_t> stack {};
+
+    for (size_t pc {0}; pc < formatted.size(); ++pc) {
+        if (pc % cancellationInterval == 0) checkCancelled();
+        const token &t {formatted[pc]};
+        switch (t.type) {
+            case tokenType::i32:
+            case tokenType::f32:
+                stack.push_back(t.intData);
+                break;
+
+            case tokenType::var:
+                if (t.slot >= bindings.size()) {
+                    fail("Unbound variable: ", t.strData);
+                }
+
+                stack.push_back(bindings[t.slot]);
+                break;
+
+            case tokenType::fun: {
+                int64_t result {};
+
+                switch ((builtinSlot)t.slot) {
+                    case builtinSlot::abs:
+                        result = stack.back();
+                        if (result == INT64_MIN) decimalOverflow();
+                        result = result < 0 ? -result : result;
+                        break;
+
+                    case builtinSlot::floor: {
+                        const int64_t units {stack.back()};
+                        result = units / one * one;
+                        if (result > units) result -= one;
+                        break;
+                    }
+
+                    case builtinSlot::min:
+                    case builtinSlot::max: {
+                        const int64_t rhs {stack.back()};
+                        stack.pop_back();
+                        result = ((builtinSlot)t.slot == builtinSlot::min) == (rhs < stack.back()) ? rhs : stack.back();
+                        break;
+                    }
+
+                    default:
+                        fail(builtins[t.slot].name, " is not exact in decimal mode");
+                }
+
+                stack.back() = result;
+                break;
+            }
+
+            case tokenType::jz: {
+                const int64_t cond {stack.back()};
+                stack.pop_back();
+
+                if (cond == 0) {
+                    pc += t.intData;
+                }
+                break;
+            }
+
+            case tokenType::jmp:
+                pc += t.intData;
+                break;
+
+            case tokenType::col: {
+                const int64_t otherwise {stack.back()};
+                stack.pop_back();
+                const int64_t then {stack.back()};
+                stack.pop_back();
+
+                stack.back() = stack.back() != 0 ? then : otherwise;
+                break;
+            }
+
+            case tokenType::add:
+            case tokenType::sub:
+            case tokenType::mul:
+            case tokenType::div:
+            case tokenType::mod:
+            case tokenType::exp:
+            case tokenType::lt:
+            case tokenType::gt:
+            case tokenType::le:
+            case tokenType::ge:
+            case tokenType::eq:
+            case tokenType::ne:
+            case tokenType::land:
+            case tokenType::lor: {
+                if (t.unary) {
+                    if (stack.back() == INT64_MIN) decimalOverflow();
+                    stack.back() = -stack.back();
+                    break;
+                }
+
+                const int64_t rhs {stack.back()};
+                stack.pop_back();
+                const int64_t lhs {stack.back()};
+                int64_t &result {stack.back()};
+
+                switch (t.type) {
+                    case tokenType::add:
+                        if (__builtin_add_overflow(lhs, rhs, &result)) decimalOverflow();
+                        break;
+
+                    case tokenType::sub:
+                        if (__builtin_sub_overflow(lhs, rhs, &result)) decimalOverflow();
+                        break;
+
+                    case tokenType::mul:
+                        result = decimalMul(lhs, rhs, one);
+                        break;
+
+                    case tokenType::div:
+                        result = decimalDiv(lhs, rhs, one);
+                        break;
+
+                    case tokenType::mod:
+                        if (rhs == 0) {
+                            fail("Division by zero");
+                        }
+                        result = rhs == -1 ? 0 : lhs % rhs; // INT64_MIN % -1 traps.
+                        break;
+
+                    case tokenType::exp:
+                        result = decimalPow(lhs, rhs, one);
+                        break;
+
+                    case tokenType::lt: result = lhs < rhs ? one : 0; break;
+                    case tokenType::gt: result = lhs > rhs ? one : 0; break;
+                    case tokenType::le: result = lhs <= rhs ? one : 0; break;
+                    case tokenType::ge: result = lhs >= rhs ? one : 0; break;
+                    case tokenType::eq: result = lhs == rhs ? one : 0; break;
+                    case tokenType::ne: result = lhs != rhs ? one : 0; break;
+                    case tokenType::land: result = lhs != 0 && rhs != 0 ? one : 0; break;
+                    case tokenType::lor: result = lhs != 0 || rhs != 0 ? one : 0; break;
+
+                    default: break;
+                }
+                break;
+            }
+
+            default: break;
+        }
+    }
+
+    return stack.back();
+}
+
+std::string decimalToString(int64_t units, int scale) {
+    const int64_t one {pow10(scale)};
+    const uint64_t magnitude {units < 0 ? 0 - (uint64_t)units : (uint64_t)units};
+
+    std::string s {units < 0 ? "-" : ""};
+    s += std::to_string(magnitude / one);
+
+    if (scale > 0) {
+        const std::string fraction {std::to_string(magnitude % one)};
+        s += '.' + std::string(scale - fraction.size(), '0') + fraction;
+    }
+
+    return s;
+}
+
+using magnitude = std::vector<uint32_t>;
+
+/* Operands with fewer limbs than this use schoolbook multiplication. */
+size_t karatsubaThreshold {64};
+
+void trim(magnitude &m) {
+    while (!m.empty() && m.back() == 0) m.pop_back();
+}
+
+magnitude toMagnitude(uint64_t value) {
+    magnitude m {(uint32_t)value, (uint32_t)(value >> 32)};
+    trim(m);
+    return m;
+}
+
+/* Splits any bigint into sign and magnitude. */
+magnitude magnitudeOf(const bigint &b, bool &negative) {
+    if (!b.isSmall()) {
+        negative = b.negative;
+        return b.limbs;
+    }
+
+    negative = b.small < 0;
+    return toMagnitude(negative ? 0 - (uint64_t)b.small : (uint64_t)b.small);
+}
+
+/* Builds a bigint, demoting to the inline form when the value fits. */
+bigint fromMagnitude(magnitude m, bool negative) {
+    trim(m);
+
+    if (m.size() <= 2) {
+        const uint64_t value {(m.empty() ? 0 : m[0]) | (m.size() < 2 ? 0 : (uint64_t)m[1] << 32)};
+
+        if (value <= (uint64_t)INT64_MAX) {
+            return bigint {negative ? -(int64_t)value : (int64_t)value};
+        }
+        if (negative && value == (uint64_t)INT64_MAX + 1) {
+            return bigint {INT64_MIN};
+        }
+    }
+
+    bigint b {};
+    b.negative = negative;
+    b.limbs = std::move(m);
+    return b;
+}
+
+int compareMagnitude(const magnitude &a, const magnitude &b) {
+    if (a.size() != b.size()) {
+        return a.size() < b.size() ? -1 : 1;
+    }
+
+    for (size_t i {a.size()}; i > 0; --i) {
+        if (a[i - 1] != b[i - 1]) {
+            return a[i - 1] < b[i - 1] ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+magnitude addMagnitude(const magnitude &a, const magnitude &b) {
+    const magnitude &longer {a.size() >= b.size() ? a : b};
+    const magnitude &shorter {a.size() >= b.size() ? b : a};
+    magnitude sum(longer.size() + 1);
+    uint64_t carry {0};
+
+    for (size_t i {0}; i < longer.size(); ++i) {
+        carry += (uint64_t)longer[i] + (i < shorter.size() ? shorter[i] : 0);
+        sum[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+
+    sum[longer.size()] = (uint32_t)carry;
+    trim(sum);
+    return sum;
+}
+
+/* a - b, requires a >= b. */
+magnitude subMagnitude(const magnitude &a, const magnitude &b) {
+    magnitude difference(a.size());
+    int64_t borrow {0};
+
+    for (size_t i {0}; i < a.size(); ++i) {
+        int64_t d {(int64_t)a[i] - (i < b.size() ? b[i] : 0) - borrow};
+        borrow = d < 0;
+        difference[i] = (uint32_t)(d + (borrow << 32));
+    }
+
+    trim(difference);
+    return difference;
+}
+
+magnitude schoolbookMul(const magnitude &a, const magnitude &b) {
+    if (a.empty() || b.empty()) {
+        return {};
+    }
+
+    magnitude product(a.size() + b.size());
+
+    for (size_t i {0}; i < a.size(); ++i) {
+        uint64_t carry {0};
+
+        for (size_t j {0}; j < b.size(); ++j) {
+            carry += (uint64_t)a[i] * b[j] + product[i + j];
+            product[i + j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+
+        product[i + b.size()] = (uint32_t)carry;
+    }
+
+    trim(product);
+    return product;
+}
+
+magnitude shiftLimbs(magnitude m, size_t count) {
+    if (!m.empty()) {
+        m.insert(m.begin(), count, 0);
+    }
+    return m;
+}
+
+/* Karatsuba: three half-size products instead of four, O(n^1.585). */
+magnitude mulMagnitude(const magnitude &a, const magnitude &b) {
+    if (std::min(a.size(), b.size()) < karatsubaThreshold) {
+        return schoolbookMul(a, b);
+    }
+
+    const size_t half {std::max(a.size(), b.size()) / 2};
+    const auto low {[&](const magnitude &m) {
+        magnitude l(m.begin(), m.begin() + (long)std::min(half, m.size()));
+        trim(l);
+        return l;
+    }};
+    const auto high {[&](const magnitude &m) {
+        return m.size() > half ? magnitude(m.begin() + (long)half, m.end()) : magnitude {};
+    }};
+
+    const magnitude a0 {low(a)}, a1 {high(a)}, b0 {low(b)}, b1 {high(b)};
+    const magnitude z0 {mulMagnitude(a0, b0)};
+    const magnitude z2 {mulMagnitude(a1, b1)};
+    const magnitude z1 {subMagnitude(subMagnitude(mulMagnitude(addMagnitude(a0, a1), addMagnitude(b0, b1)), z0), z2)};
+
+    return addMagnitude(addMagnitude(shiftLimbs(z2, 2 * half), shiftLimbs(z1, half)), z0);
+}
+
+/* Knuth's algorithm D; quotient and remainder of a / b for b != 0. */
+void divMagnitude(const magnitude &a, const magnitude &b, magnitude &quotient, magnitude &remainder) {
+    if (compareMagnitude(a, b) < 0) {
+        quotient.clear();
+        remainder = a;
+        return;
+    }
+
+    if (b.size() == 1) {
+        quotient.assign(a.size(), 0);
+        uint64_t rest {0};
+
+        for (size_t i {a.size()}; i > 0; --i) {
+            rest = rest << 32 | a[i - 1];
+            quotient[i - 1] = (uint32_t)(rest / b[0]);
+            rest %= b[0];
+        }
+
+        trim(quotient);
+        remainder = toMagnitude(rest);
+        return;
+    }
+
+    /* Normalize so the divisor's top limb has its high bit set. */
+    const int shift {__builtin_clz(b.back())};
+    const auto shiftLeft {[shift](const magnitude &m, size_t extra) {
+        magnitude r(m.size() + extra);
+        for (size_t i {0}; i < m.size(); ++i) {
+            r[i] |= m[i] << shift;
+            if (shift > 0 && i + 1 < r.size()) r[i + 1] = (uint32_t)((uint64_t)m[i] >> (32 - shift));
+        }
+        return r;
+    }};
+
+    const magnitude v {shiftLeft(b, 0)};
+    magnitude u {shiftLeft(a, 1)};
+    const size_t n {v.size()}, m {a.size() - b.size()};
+    quotient.assign(m + 1, 0);
+
+    for (size_t j {m + 1}; j > 0; --j) {
+        const size_t k {j - 1};
+        const uint64_t top {(uint64_t)u[k + n] << 32 | u[k + n - 1]};
+        uint64_t qhat {top / v[n - 1]};
+        uint64_t rhat {top % v[n - 1]};
+
+        while (qhat > UINT32_MAX || qhat * v[n - 2] > (rhat << 32 | u[k + n - 2])) {
+            --qhat;
+            rhat += v[n - 1];
+            if (rhat > UINT32_MAX) break;
+        }
+
+        int64_t borrow {0};
+        uint64_t carry {0};
+        for (size_t i {0}; i < n; ++i) {
+            carry += qhat * v[i];
+            const int64_t d {(int64_t)u[i + k] - (int64_t)(uint32_t)carry - borrow};
+            carry >>= 32;
+            borrow = d < 0;
+            u[i + k] = (uint32_t)(d + (borrow << 32));
+        }
+        const int64_t d {(int64_t)u[k + n] - (int64_t)carry - borrow};
+        u[k + n] = (uint32_t)d;
+
+        /* qhat was one too large: add the divisor back. */
+        if (d < 0) {
+            --qhat;
+            uint64_t c {0};
+            for (size_t i {0}; i < n; ++i) {
+                c += (uint64_t)u[i + k] + v[i];
+                u[i + k] = (uint32_t)c;
+                c >>= 32;
+            }
+            u[k + n] += (uint32_t)c;
+        }
+
+        quotient[k] = (uint32_t)qhat;
+    }
+
+    trim(quotient);
+
+    remainder.assign(n, 0);
+    for (size_t i {0}; i < n; ++i) {
+        remainder[i] = u[i] >> shift;
+        if (shift > 0) remainder[i] |= (uint32_t)((uint64_t)u[i + 1] << (32 - shift));
+    }
+    trim(remainder);
+}
+
+bigint bigAdd(const bigint &a, const bigint &b) {
+    int64_t sum {};
+    if (a.isSmall() && b.isSmall() && !__builtin_add_overflow(a.small, b.small, &sum)) {
+        return bigint {sum};
+    }
+
+    bool an {}, bn {};
+    const magnitude am {magnitudeOf(a, an)}, bm {magnitudeOf(b, bn)};
+
+    if (an == bn) {
+        return fromMagnitude(addMagnitude(am, bm), an);
+    }
+
+    return compareMagnitude(am, bm) >= 0 ? fromMagnitude(subMagnitude(am, bm), an)
+                                         : fromMagnitude(subMagnitude(bm, am), bn);
+}
+
+bigint bigNegate(const bigint &a) {
+    if (a.isSmall() && a.small != INT64_MIN) {
+        return bigint {-a.small};
+    }
+
+    bool negative {};
+    const magnitude m {magnitudeOf(a, negative)};
+    return fromMagnitude(m, !negative && !m.empty());
+}
+
+bigint bigMul(const bigint &a, const bigint &b) {
+    int64_t product {};
+    if (a.isSmall() && b.isSmall() && !__builtin_mul_overflow(a.small, b.small, &product)) {
+        return bigint {product};
+    }
+
+    bool an {}, bn {};
+    const magnitude m {mulMagnitude(magnitudeOf(a, an), magnitudeOf(b, bn))};
+    return fromMagnitude(m, an != bn && !m.empty());
+}
+
+/* Truncating division like C: the remainder takes the sign of the dividend. */
+bigint bigDivMod(const bigint &a, const bigint &b, bool wantRemainder) {
+    if (b.isSmall() && b.small == 0) {
+        fail("Division by zero");
+    }
+
+    if (a.isSmall() && b.isSmall() && !(a.small == INT64_MIN && b.small == -1)) {
+        return bigint {wantRemainder ? a.small % b.small : a.small / b.small};
+    }
+
+    bool an {}, bn {};
+    magnitude quotient {}, remainder {};
+    divMagnitude(magnitudeOf(a, an), magnitudeOf(b, bn), quotient, remainder);
+
+    return wantRemainder ? fromMagnitude(remainder, an && !remainder.empty())
+                         : fromMagnitude(quotient, an != bn && !quotient.empty());
+}
+
+int bigCompare(const bigint &a, const bigint &b) {
+    if (a.isSmall() && b.isSmall()) {
+        return a.small < b.small ? -1 : a.small > b.small;
+    }
+
+    bool an {}, bn {};
+    const magnitude am {magnitudeOf(a, an)}, bm {magnitudeOf(b, bn)};
+
+    if (an != bn) {
+        return an ? -1 : 1;
+    }
+
+    return an ? -compareMagnitude(am, bm) : compareMagnitude(am, bm);
+}
+
+/* Results above this many bits are refused rather than exhausting memory. */
+constexpr uint64_t maxBigBits {1u << 26};
+
+bigint bigPow(bigint base, const bigint &exponent) {
+    if (!exponent.isSmall() || exponent.small < 0) {
+        fail("Bignum mode only supports non-negative exponents that fit in 64 bits");
+    }
+
+    bool negative {};
+    const magnitude m {magnitudeOf(base, negative)};
+    const uint64_t bits {m.empty() ? 0 : m.size() * 32 - __builtin_clz(m.back())};
+
+    if (bits > 1 && (uint64_t)exponent.small > maxBigBits / (bits - 1)) {
+        fail("Bignum result too large");
+    }
+
+    bigint result {1};
+    for (uint64_t n {(uint64_t)exponent.small}; n > 0; n >>= 1) {
+        if (n & 1) result = bigMul(result, base);
+        if (n > 1) base = bigMul(base, base);
+    }
+
+    return result;
+}
+
+bigint bigLiteral(const token &t) {
+    if (t.strData.empty() || t.strData.find('.') != std::string::npos) {
+        fail("Bignum mode only supports integers: ", t.strData);
+    }
+
+    magnitude m {};
+    for (size_t i {0}; i < t.strData.size(); i += 9) {
+        const std::string chunk {t.strData.substr(i, 9)};
+        uint64_t scale {1};
+        for (size_t k {0}; k < chunk.size(); ++k) scale *= 10;
+
+        uint64_t carry {std::stoul(chunk)};
+        for (uint32_t &limb: m) {
+            carry += (uint64_t)limb * scale;
+            limb = (uint32_t)carry;
+            carry >>= 32;
+        }
+        if (carry > 0) m.push_back((uint32_t)carry);
+    }
+
+    return fromMagnitude(m, false);
+}
+
+std::string bigToString(const bigint &b) {
+    if (b.isSmall()) {
+        return std::to_string(b.small);
+    }
+
+    magnitude m {b.limbs};
+    std::string digits {};
+
+    while (!m.empty()) {
+        uint64_t rest {0};
+        for (size_t i {m.size()}; i > 0; --i) {
+            rest = rest << 32 | m[i - 1];
+            m[i - 1] = (uint32_t)(rest / 1000000000);
+            rest %= 1000000000;
+        }
+        trim(m);
+
+        std::string chunk {std::to_string(rest)};
+        if (!m.empty()) chunk.insert(0, 9 - chunk.size(), '0');
+        digits.insert(0, chunk);
+    }
+
+    return (b.negative ? "-" : "") + digits;
+}
+
+bigint computeBig(const std::deque<token> &formatted, const std::vector<bigint> &bindings = {}) {
+    std::vector<bigint> stack {};
+
+    for (size_t pc {0}; pc < formatted.size(); ++pc) {
+        if (pc % cancellationInterval == 0) checkCancelled();
+        const token &t {formatted[pc]};
+        switch (t.type) {
+            case tokenType::i32:
+            case tokenType::f32:
+                stack.push_back(bigLiteral(t));
+                break;
+
+            case tokenType::var:
+                if (t.slot >= bindings.size()) {
+                    fail("Unbound variable: ", t.strData);
+                }
+
+                stack.push_back(bindings[t.slot]);
+                break;
+
+            case tokenType::fun:
+                switch ((builtinSlot)t.slot) {
+                    case builtinSlot::abs:
+                        if (bigCompare(stack.back(), 0) < 0) stack.back() = bigNegate(stack.back());
+                        break;
+
+                    case builtinSlot::min:
+                    case builtinSlot::max: {
+                        const bigint rhs {stack.back()};
+                        stack.pop_back();
+                        if (((builtinSlot)t.slot == builtinSlot::min) == (bigCompare(rhs, stack.back()) < 0)) stack.back() = rhs;
+                        break;
+                    }
+
+                    case builtinSlot::floor:
+                        break;
+
+                    default:
+                        fail(builtins[t.slot].name, " is not exact in bignum mode");
+                }
+                break;
+
+            case tokenType::jz: {
+                const bool zero {bigCompare(stack.back(), 0) == 0};
+                stack.pop_back();
+
+                if (zero) {
+                    pc += t.intData;
+                }
+                break;
+            }
+
+            case tokenType::jmp:
+                pc += t.intData;
+                break;
+
+            case tokenType::col: {
+                const bigint otherwise {stack.back()};
+                stack.pop_back();
+                const bigint then {stack.back()};
+                stack.pop_back();
+
+                stack.back() = bigCompare(stack.back(), 0) != 0 ? then : otherwise;
+                break;
+            }
+
+            case tokenType::add:
+            case tokenType::sub:
+            case tokenType::mul:
+            case tokenType::div:
+            case tokenType::mod:
+            case tokenType::exp:
+            case tokenType::lt:
+            case tokenType::gt:
+            case tokenType::le:
+            case tokenType::ge:
+            case tokenType::eq:
+            case tokenType::ne:
+            case tokenType::land:
+            case tokenType::lor: {
+                if (t.unary) {
+                    stack.back() = bigNegate(stack.back());
+                    break;
+                }
+
+                const bigint rhs {stack.back()};
+                stack.pop_back();
+                bigint &result {stack.back()};
+                const int order {bigCompare(result, rhs)};
+
+                switch (t.type) {
+                    case tokenType::add: result = bigAdd(result, rhs); break;
+                    case tokenType::sub: result = bigAdd(result, bigNegate(rhs)); break;
+                    case tokenType::mul: result = bigMul(result, rhs); break;
+                    case tokenType::div: result = bigDivMod(result, rhs, false); break;
+                    case tokenType::mod: result = bigDivMod(result, rhs, true); break;
+                    case tokenType::exp: result = bigPow(result, rhs); break;
+                    case tokenType::lt: result = order < 0; break;
+                    case tokenType::gt: result = order > 0; break;
+                    case tokenType::le: result = order <= 0; break;
+                    case tokenType::ge: result = order >= 0; break;
+                    case tokenType::eq: result = order == 0; break;
+                    case tokenType::ne: result = order != 0; break;
+                    case tokenType::land: result = bigCompare(result, 0) != 0 && bigCompare(rhs, 0) != 0; break;
+                    case tokenType::lor: result = bigCompare(result, 0) != 0 || bigCompare(rhs, 0) != 0; break;
+                    default: break;
+                }
+                break;
+            }
+
+            default: break;
+        }
+    }
+
+    return stack.back();
+}
+
+/* Complex mode: ^ goes through polar form, a^b = exp(b * log a) with log a = ln|a| + i arg(a). */
+std::complex<float> complexPow(std::complex<float> a, std::complex<float> b) {
+    if (a == 0.0f) {
+        return b == 0.0f ? 1.0f : 0.0f;
+    }
+
+    const float lnr {std::log(std::abs(a))};
+    const float theta {std::arg(a)};
+    return std::polar(std::exp(b.real() * lnr - b.imag() * theta), b.imag() * lnr + b.real() * theta);
+}
+
+[[noreturn]] void notComplex(const std::string &what) {
+    fail(what, " is not defined for complex numbers");
+}
+
+/* Orders real values only; a comparison involving a non-zero imaginary part is an error. */
+int complexOrder(std::complex<float> lhs, std::complex<float> rhs) {
+    if (lhs.imag() != 0.0f || rhs.imag() != 0.0f) {
+        notComplex("Ordering");
+    }
+
+    return lhs.real() < rhs.real() ? -1 : lhs.real() > rhs.real();
+}
+
+std::complex<float> computeComplex(const std::deque<token> &formatted, const std::vector<std::complex<float>> &bindings = {}) {
+    std::vector<std::complex<float>> stack {};
+
+    for (size_t pc {0}; pc < formatted.size(); ++pc) {
+        if (pc % cancellationInterval == 0) checkCancelled();
+        const token &t {formatted[pc]};
+        switch (t.type) {
+            case tokenType::i32:
+                stack.emplace_back((float)t.intData);
+                break;
+
+            case tokenType::f32:
+                stack.emplace_back(t.fltData);
+                break;
+
+            case tokenType::img:
+                stack.emplace_back(0.0f, t.fltData);
+                break;
+
+            case tokenType::var:
+                if (t.slot >= bindings.size()) {
+                    fail("Unbound variable: ", t.strData);
+                }
+
+                stack.push_back(bindings[t.slot]);
+                break;
+
+            case tokenType::fun: {
+                std::complex<float> &z {stack.back()};
+
+                switch ((builtinSlot)t.slot) {
+                    case builtinSlot::sqrt: z = std::sqrt(z); break;
+                    case builtinSlot::abs: z = std::abs(z); break;
+                    case builtinSlot::exp: z = std::exp(z); break;
+                    case builtinSlot::log: z = std::log(z); break;
+                    case builtinSlot::sin: z = std::sin(z); break;
+                    case builtinSlot::cos: z = std::cos(z); break;
+                    case builtinSlot::floor: z = {std::floor(z.real()), std::floor(z.imag())}; break;
+                    default: notComplex(builtins[t.slot].name);
+                }
+                break;
+            }
+
+            case tokenType::jz: {
+                const bool zero {stack.back() == 0.0f};
+                stack.pop_back();
+
+                if (zero) {
+                    pc += t.intData;
+                }
+                break;
+            }
+
+            case tokenType::jmp:
+                pc += t.intData;
+                break;
+
+            case tokenType::col: {
+                const std::complex<float> otherwise {stack.back()};
+                stack.pop_back();
+                const std::complex<float> then {stack.back()};
+                stack.pop_back();
+
+                stack.back() = stack.back() != 0.0f ? then : otherwise;
+                break;
+            }
+
+            case tokenType::add:
+            case tokenType::sub:
+            case tokenType::mul:
+            case tokenType::div:
+            case tokenType::mod:
+            case tokenType::exp:
+            case tokenType::lt:
+            case tokenType::gt:
+            case tokenType::le:
+            case tokenType::ge:
+            case tokenType::eq:
+            case tokenType::ne:
+            case tokenType::land:
+            case tokenType::lor: {
+                /* 0 - z rather than -z, so -4 stays on the positive side of sqrt's branch cut. */
+                if (t.unary) {
+                    stack.back() = std::complex<float> {} - stack.back();
+                    break;
+                }
+
+                const std::complex<float> rhs {stack.back()};
+                stack.pop_back();
+                std::complex<float> &result {stack.back()};
+
+                switch (t.type) {
+                    case tokenType::add: result += rhs; break;
+                    case tokenType::sub: result -= rhs; break;
+                    case tokenType::mul: result *= rhs; break;
+                    case tokenType::div: result /= rhs; break;
+                    case tokenType::mod: notComplex("%");
+                    case tokenType::exp: result = complexPow(result, rhs); break;
+                    case tokenType::lt: result = (float)(complexOrder(result, rhs) < 0); break;
+                    case tokenType::gt: result = (float)(complexOrder(result, rhs) > 0); break;
+                    case tokenType::le: result = (float)(complexOrder(result, rhs) <= 0); break;
+                    case tokenType::ge: result = (float)(complexOrder(result, rhs) >= 0); break;
+                    case tokenType::eq: result = (float)(result == rhs); break;
+                    case tokenType::ne: result = (float)(result != rhs); break;
+                    case tokenType::land: result = (float)(result != 0.0f && rhs != 0.0f); break;
+                    case tokenType::lor: result = (float)(result != 0.0f || rhs != 0.0f); break;
+                    default: break;
+                }
+                break;
+            }
+
+            default: break;
+        }
+    }
+
+    return stack.back();
+}
+
+std::string complexToString(std::complex<float> z) {
+    std::ostringstream out {};
+    out << z.real();
+
+    if (z.imag() != 0.0f) {
+        out << (std::signbit(z.imag()) ? " - " : " + ") << std::fabs(z.imag()) << 'i';
+    }
+
+    return out.str();
+}
+
+/* Number of operands a token pops off the evaluation stack. */
+size_t arity(const token &t) {
+    switch (t.type) {
+        case tokenType::fun:
+        case tokenType::call:
+        case tokenType::lbr:
+        case tokenType::form:
+            return t.argc;
+
+        case tokenType::add:
+        case tokenType::sub:
+        case tokenType::mul:
+        case tokenType::div:
+        case tokenType::mod:
+        case tokenType::exp:
+            return t.unary ? 1 : 2;
+
+        case tokenType::lt:
+        case tokenType::gt:
+        case tokenType::le:
+        case tokenType::ge:
+        case tokenType::eq:
+        case tokenType::ne:
+        case tokenType::land:
+        case tokenType::lor:
+            return 2;
+
+        case tokenType::col:
+            return 3;
+
+        default:
+            return 0;
+    }
+}
+
+/* Index of the first token of the operand that ends just before end. */
+size_t operandStart(const std::deque<token> &formatted, size_t end) {
+    size_t needed {1};
+
+    while (needed > 0) {
+        --end;
+        needed = needed - 1 + arity(formatted[end]);
+    }
+
+    return end;
+}
+
+/* Replaces every call to a user function with its body, substituting the argument operands for its parameters. */
+std::deque<token> inlineCalls(const std::deque<token> &formatted, const environment &env) {
+    std::deque<token> out {};
+
+    for (const token &t: formatted) {
+        if (t.type != tokenType::call) {
+            out.push_back(t);
+            continue;
+        }
+
+        const userFunction &f {env.functions[t.slot]};
+        if (t.argc != f.params.size()) {
+            fail(f.name, " takes ", f.params.size(), " argument(s), got ", t.argc);
+        }
+
+        std::vector<std::deque<token>> args(t.argc);
+        for (size_t a {t.argc}; a > 0; --a) {
+            const size_t start {operandStart(out, out.size())};
+            args[a - 1].assign(out.begin() + (long)start, out.end());
+            out.erase(out.begin() + (long)start, out.end());
+        }
+
+        for (const token &b: f.body) {
+            if (b.type == tokenType::arg) {
+                out.insert(out.end(), args[b.slot].begin(), args[b.slot].end());
+            }
+            else {
+                out.push_back(b);
+            }
+        }
+    }
+
+    return out;
+}
+
+/* Constant propagation: evaluates every operator whose operands are all literals at compile time. */
+std::deque<token> fold(const std::deque<token> &formatted) {
+    std::deque<token> out {};
+
+    for (const token &t: formatted) {
+        out.push_back(t);
+
+        const size_t n {arity(t)};
+        if (n == 0 || t.type == tokenType::call || t.type == tokenType::lbr || t.type == tokenType::form || n >= out.size()
+            || (t.type == tokenType::fun && builtins[t.slot].random)) {
+            continue;
+        }
+
+        /* A select on a literal condition compiles to the branch it picks. */
+        if (t.type == tokenType::col) {
+            const size_t elseStart {operandStart(out, out.size() - 1)};
+            const size_t thenStart {operandStart(out, elseStart)};
+            const size_t condStart {operandStart(out, thenStart)};
+            const token cond {out[condStart]};
+
+            if (thenStart - condStart == 1 && (cond.type == tokenType::i32 || cond.type == tokenType::f32)) {
+                const bool taken {cond.type == tokenType::i32 ? cond.intData != 0 : cond.fltData != 0.0f};
+                const std::deque<token> branch(out.begin() + (long)(taken ? thenStart : elseStart),
+                                               out.begin() + (long)(taken ? elseStart : out.size() - 1));
+
+                out.erase(out.begin() + (long)condStart, out.end());
+                out.insert(out.end(), branch.begin(), branch.end());
+            }
+            continue;
+        }
+
+        bool constant {true};
+        for (size_t k {out.size() - 1 - n}; k < out.size() - 1; ++k) {
+            constant = constant && (out[k].type == tokenType::i32 || out[k].type == tokenType::f32);
+        }
+
+        if (constant) {
+            const std::deque<token> operation(out.end() - (long)(n + 1), out.end());
+
+            token literal {};
+            literal.type = tokenType::f32;
+            literal.fltData = compute(operation);
+
+            out.erase(out.end() - (long)(n + 1), out.end());
+            out.push_back(literal);
+        }
+    }
+
+    return out;
+}
+
+/* Whether formatted has a ?:, && or || for lowerBranches to rewrite. */
+bool hasBranches(const std::deque<token> &formatted) {
+    return std::any_of(formatted.begin(), formatted.end(), [](const token &t) {
+        return t.type == tokenType::col || t.type == tokenType::land || t.type == tokenType::lor;
+    });
+}
+
+/*
+ * Scalar mode only: rewrites ?:, && and || into jz/jmp so compute evaluates
+ * just the branch that is taken. Batch mode keeps the branchless form.
+ *
+ * One pass over the postfix program with a stack of lowered operands, as
+ * compute runs it, so long operand chains cost neither recursion depth nor
+ * rescans. Operands are joined onto the largest of them, at either end of
+ * its deque, which keeps joining linear in practice.
+ */
+std::deque<token> lowerBranches(const std::deque<token> &formatted) {
+    if (!hasBranches(formatted)) {
+        return formatted;
+    }
+
+    token jump {};
+    jump.type = tokenType::jmp;
+    token branch {};
+    branch.type = tokenType::jz;
+    token zero {};
+    zero.type = tokenType::i32;
+    token one {zero};
+    one.intData = 1;
+    token truthy {};
+    truthy.type = tokenType::ne;
+    truthy.strData = "!=";
+
+    std::vector<std::deque<token>> operands {};
+
+    for (const token &t: formatted) {
+        const size_t n {arity(t)};
+        if (n > operands.size()) {
+            fail("Missing operand: ", t.toString());
+        }
+
+        std::vector<std::deque<token>> args(std::make_move_iterator(operands.end() - (long)n), std::make_move_iterator(operands.end()));
+        operands.resize(operands.size() - n);
+
+        const auto by {[](token instruction, size_t offset) {
+            instruction.intData = (long)offset;
+            return instruction;
+        }};
+
+        /* The jumps and glue of each form go on the end of the operand before them. */
+        switch (t.type) {
+            /* cond jz(then + 1) then jmp(else) else */
+            case tokenType::col:
+                args[0].push_back(by(branch, args[1].size() + 1));
+                args[1].push_back(by(jump, args[2].size()));
+                break;
+
+            /* lhs jz(rhs + 3) rhs 0 ne jmp(1) 0 */
+            case tokenType::land:
+                args[0].push_back(by(branch, args[1].size() + 3));
+                args[1].insert(args[1].end(), {zero, truthy, by(jump, 1), zero});
+                break;
+
+            /* lhs jz(2) 1 jmp(rhs + 2) rhs 0 ne */
+            case tokenType::lor:
+                args[0].insert(args[0].end(), {by(branch, 2), one, by(jump, args[1].size() + 2)});
+                args[1].insert(args[1].end(), {zero, truthy});
+                break;
+
+            default:
+                args.push_back({t});
+                break;
+        }
+
+        size_t largest {0};
+        for (size_t k {1}; k < args.size(); ++k) {
+            largest = args[k].size() > args[largest].size() ? k : largest;
+        }
+
+        std::deque<token> joined {std::move(args[largest])};
+        for (size_t k {largest}; k > 0; --k) {
+            joined.insert(joined.begin(), args[k - 1].begin(), args[k - 1].end());
+        }
+        for (size_t k {largest + 1}; k < args.size(); ++k) {
+            joined.insert(joined.end(), args[k].begin(), args[k].end());
+        }
+
+        operands.push_back(std::move(joined));
+    }
+
+    return std::move(operands.back());
+}
+
+/* fuse rewrites a binary operator whose right operand is pushed just before it to these. */
+static const std::pair<tokenType, std::array<tokenType, 2>> operandFusions[] {
+    {tokenType::add, {tokenType::addk, tokenType::addv}},
+    {tokenType::sub, {tokenType::subk, tokenType::subv}},
+    {tokenType::mul, {tokenType::mulk, tokenType::mulv}},
+    {tokenType::div, {tokenType::divk, tokenType::divv}},
+};
+
+/*
+ * Float scalar mode only, after lowerBranches: merges the commonest
+ * instruction sequences of --profile-corpus into superinstructions, so that
+ * compute dispatches once for each: a literal or variable followed by
+ * + - * or / (addk, addv, ...), * followed by + (fma), and * followed by a
+ * literal or variable and + (fmak, fmav). A jump target always starts an
+ * instruction, and jumps are retargeted to the shorter program.
+ */
+std::deque<token> fuse(const std::deque<token> &formatted) {
+    const size_t n {formatted.size()};
+    std::vector<bool> target(n + 1, false);
+    for (size_t pc {0}; pc < n; ++pc) {
+        if (formatted[pc].type == tokenType::jz || formatted[pc].type == tokenType::jmp) {
+            target[pc + (size_t)formatted[pc].intData + 1] = true;
+        }
+    }
+
+    const auto binary {[&](size_t pc, tokenType type) {
+        return pc < n && !target[pc] && formatted[pc].type == type && !formatted[pc].unary;
+    }};
+    const auto operand {[&](size_t pc) {
+        return pc < n && !target[pc] && (formatted[pc].type == tokenType::i32 || formatted[pc].type == tokenType::f32
+                                         || formatted[pc].type == tokenType::var);
+    }};
+    const auto fusesMultiplyAdd {[&](size_t pc) {
+        return binary(pc, tokenType::mul) && (binary(pc + 1, tokenType::add) || (operand(pc + 1) && binary(pc + 2, tokenType::add)));
+    }};
+    /* Moves the literal or variable at pc into fused. */
+    const auto absorb {[&](token &fused, size_t pc) {
+        const token &t {formatted[pc]};
+        fused.fltData = t.type == tokenType::i32 ? (float)t.intData : t.fltData;
+        fused.slot = t.slot;
+        fused.strData = t.strData;
+    }};
+
+    std::deque<token> out {};
+    std::vector<size_t> moved(n + 1); // Index in out of each instruction of formatted.
+
+    for (size_t pc {0}; pc < n;) {
+        moved[pc] = out.size();
+        token t {formatted[pc]};
+        size_t length {1};
+
+        if (fusesMultiplyAdd(pc) && operand(pc + 1)) {
+            absorb(t, pc + 1);
+            t.type = formatted[pc + 1].type == tokenType::var ? tokenType::fmav : tokenType::fmak;
+            length = 3;
+        }
+        else if (fusesMultiplyAdd(pc)) {
+            t.type = tokenType::fma;
+            length = 2;
+        }
+        /* An operand before a multiply-add is left alone; fusing either costs the same dispatches, but fma rounds once. */
+        else if (operand(pc) && pc + 1 < n && !target[pc + 1] && !formatted[pc + 1].unary && !fusesMultiplyAdd(pc + 1)) {
+            for (const auto &[op, fused]: operandFusions) {
+                if (formatted[pc + 1].type == op) {
+                    absorb(t, pc);
+                    t.type = fused[formatted[pc].type == tokenType::var];
+                    length = 2;
+                    break;
+                }
+            }
+        }
+
+        for (size_t i {1}; i < length; ++i) {
+            moved[pc + i] = out.size();
+        }
+
+        out.push_back(t);
+        pc += length;
+    }
+
+    moved[n] = out.size();
+    for (size_t pc {0}; pc < n; ++pc) {
+        if (formatted[pc].type == tokenType::jz || formatted[pc].type == tokenType::jmp) {
+            out[moved[pc]].intData = (long)(moved[pc + (size_t)formatted[pc].intData + 1] - moved[pc] - 1);
+        }
+    }
+
+    return out;
+}
+
+bool containsArray(const std::deque<token> &formatted) {
+    return std::any_of(formatted.begin(), formatted.end(), [](const token &t) { return t.type == tokenType::lbr; });
+}
+
+/* Whether formatted draws from uniform or normal, so that two evaluations of it may differ. */
+bool drawsRandom(const std::deque<token> &formatted) {
+    return std::any_of(formatted.begin(), formatted.end(), [](const token &t) {
+        return t.type == tokenType::fun && builtins[t.slot].random;
+    });
+}
+
+/*
+ * Forms nested deeper than this fail to compile, and readProgram takes them
+ * for corrupt data rather than recursing into them; evaluation recurses once
+ * per level too.
+ */
+constexpr size_t maxFormNesting {256};
+
+/* Levels of forms nested in a lowered program: 0 if it has none. */
+size_t formNesting(const std::deque<token> &formatted) {
+    size_t nesting {0};
+    for (const token &t: formatted) {
+        if (t.type == tokenType::form && t.body != nullptr) {
+            nesting = std::max(nesting, 1 + formNesting(*t.body));
+        }
+    }
+
+    return nesting;
+}
+
+/*
+ * Moves the expression argument of every special form into the form token as
+ * a folded subprogram, recording the slot of the variable it binds; the
+ * remaining arguments stay operands. Inner forms are lowered first.
+ */
+std::deque<token> lowerForms(const std::deque<token> &formatted) {
+    std::deque<token> out {};
+
+    for (token t: formatted) {
+        if (t.type != tokenType::form || t.body != nullptr) {
+            out.push_back(t);
+            continue;
+        }
+
+        const specialForm &form {forms[t.slot]};
+        std::vector<std::deque<token>> args(t.argc);
+        for (size_t a {t.argc}; a > 0; --a) {
+            const size_t start {operandStart(out, out.size())};
+            args[a - 1].assign(out.begin() + (long)start, out.end());
+            out.erase(out.begin() + (long)start, out.end());
+        }
+
+        const std::deque<token> &variable {args[form.variable]};
+        if (variable.size() != 1 || variable[0].type != tokenType::var) {
+            fail("Argument ", form.variable + 1, " of ", form.name, " must be a variable name");
+        }
+
+        if (containsArray(args[form.body])) {
+            fail("The expression of ", form.name, " must be scalar");
+        }
+
+        for (const token &b: args[form.body]) {
+            if (b.type == tokenType::fun && builtins[b.slot].random) {
+                fail("Random variables cannot appear inside ", form.name);
+            }
+        }
+
+        for (size_t a {0}; a < t.argc; ++a) {
+            if (a != form.body && a != form.variable) {
+                out.insert(out.end(), args[a].begin(), args[a].end());
+            }
+        }
+
+        t.body = std::make_shared<const std::deque<token>>(fold(args[form.body]));
+        if (formNesting(*t.body) >= maxFormNesting) {
+            fail("Forms nested more than ", maxFormNesting, " deep");
+        }
+
+        t.intData = (long)variable[0].slot;
+        t.argc -= 2;
+        out.push_back(t);
+    }
+
+    return out;
+}
+
+/* Marks the variable slots the program reads. A form's own variable is bound inside it, not read. */
+void markReads(const std::deque<token> &formatted, std::vector<bool> &read) {
+    for (const token &t: formatted) {
+        if (t.type == tokenType::var) {
+            read.resize(std::max(read.size(), t.slot + 1));
+            read[t.slot] = true;
+        }
+
+        if (t.type == tokenType::form && t.body != nullptr) {
+            std::vector<bool> inner {};
+            markReads(*t.body, inner);
+            if ((size_t)t.intData < inner.size()) inner[(size_t)t.intData] = false;
+
+            read.resize(std::max(read.size(), inner.size()));
+            for (size_t v {0}; v < inner.size(); ++v) {
+                read[v] = read[v] || inner[v];
+            }
+        }
+    }
+}
+
+/* Fails unless every variable the program reads has been given a value. */
+void checkAssigned(const std::deque<token> &formatted, const environment &env) {
+    std::vector<bool> read {};
+    markReads(formatted, read);
+
+    for (size_t slot {0}; slot < read.size(); ++slot) {
+        if (read[slot] && !env.hasValue(slot)) {
+            fail("Unbound variable: ", env.variables[slot]);
+        }
+    }
+}
+
+/*
+ * A cache entry for compiled, lowered once here rather than on every
+ * evaluation, and in float mode fused as well, so the REPL, pipe, --serve and
+ * --batch-file run superinstructions as the C library does. Array programs
+ * are never lowered.
+ */
+std::shared_ptr<const cachedProgram> makeCachedProgram(std::deque<token> compiled, evalMode mode) {
+    cachedProgram program {};
+    if (!containsArray(compiled)) {
+        if (mode == evalMode::real) {
+            program.lowered = fuse(lowerBranches(compiled));
+        }
+        else if (hasBranches(compiled)) {
+            program.lowered = lowerBranches(compiled);
+        }
+    }
+
+    std::vector<bool> read {};
+    markReads(compiled, read);
+    for (size_t slot {0}; slot < read.size(); ++slot) {
+        if (read[slot]) program.reads.push_back(slot);
+    }
+
+    program.compiled = std::move(compiled);
+    return std::make_shared<const cachedProgram>(std::move(program));
+}
+
+/* The passes of compile after parsing: inlines, checks and folds the RPN of an expression. */
+std::deque<token> compileParsed(const environment &env, const std::deque<token> &formatted,
+                                const std::vector<std::string> &params = {}) {
+    /* Every operator needs its operands and exactly one value must remain; "1 +" would run the stack dry. */
+    size_t depth {0};
+    for (const token &t: formatted) {
+        if (depth < arity(t)) {
+            fail("Missing operand: ", t.toString());
+        }
+
+        depth = depth + 1 - arity(t);
+    }
+
+    if (depth != 1) {
+        fail("Missing operator");
+    }
+
+    std::deque<token> inlined {inlineCalls(formatted, env)};
+
+    if (env.mode != evalMode::complex) {
+        for (const token &t: inlined) {
+            if (t.type == tokenType::img) {
+                fail("Imaginary literals need the complex mode: ", t.strData, "i");
+            }
+        }
+    }
+
+    if (env.mode != evalMode::real) {
+        for (const token &t: inlined) {
+            if (t.type == tokenType::fun && builtins[t.slot].random) {
+                fail("Random variables need the float mode: ", t.strData);
+            }
+
+            if (t.type == tokenType::form) {
+                fail(t.strData, " needs the float mode");
+            }
+        }
+    }
+
+    /* A function body keeps its forms unlowered, so that inlining can substitute arguments inside them. */
+    if (!params.empty()) {
+        return env.mode == evalMode::real ? fold(inlined) : inlined;
+    }
+
+    /* Folding computes in float, which would break the exact modes. */
+    if (env.mode == evalMode::real) {
+        return fold(lowerForms(inlined));
+    }
+
+    /* Decimal mode parses each literal's text into scaled units once, here, rather than on every evaluation. */
+    if (env.mode == evalMode::decimal) {
+        for (token &t: inlined) {
+            if (t.type == tokenType::i32 || t.type == tokenType::f32) {
+                t.intData = decimalLiteral(t, env.scale);
+            }
+        }
+    }
+
+    return inlined;
+}
+
+/* Lexes, parses, inlines and folds an expression into a program ready for compute or computeBatch. */
+std::deque<token> compile(lexana &lexer, const std::string &exprStr, const std::vector<std::string> &params = {}) {
+    lexer.lex(exprStr, params);
+    const std::deque<token> formatted {shuntingYard(lexer.getTokens())};
+    lexer.getTokens().clear();
+
+    if (formatted.empty()) {
+        return {};
+    }
+
+    return compileParsed(lexer.getEnvironment(), formatted, params);
+}
+
+/*
+ * Canonical form of a parsed expression, for caching: its RPN with one
+ * field per token that matters to the result. Parentheses, whitespace,
+ * digit separators and the choice of x or * are gone by then, so all those
+ * spellings of a formula share one key. Literals keep their digits because
+ * the exact modes read them.
+ */
+std::string canonicalKey(const std::deque<token> &formatted) {
+    std::string key {};
+
+    for (const token &t: formatted) {
+        key += (char)('A' + (int)t.type);
+
+        switch (t.type) {
+            case tokenType::i32:
+            case tokenType::f32:
+            case tokenType::img:
+            case tokenType::var:
+                key += t.strData;
+                break;
+
+            case tokenType::fun:
+            case tokenType::call:
+            case tokenType::form:
+                key += t.strData;
+                key += ':' + std::to_string(t.argc);
+                break;
+
+            case tokenType::lbr:
+                key += std::to_string(t.argc);
+                break;
+
+            case tokenType::arg:
+                key += std::to_string(t.slot);
+                break;
+
+            default:
+                if (t.unary) key += 'u';
+                break;
+        }
+
+        key += ' ';
+    }
+
+    return key;
+}
+
+[[noreturn]] void corruptData() {
+    fail("Corrupt snapshot or shared cache");
+}
+
+/*
+ * Reads the flat, pointer free encodings written by appendValue, appendString
+ * and appendProgram from the offset of a buffer of size bytes. Files and
+ * shared memory can be truncated or overwritten, so every read and every
+ * length is checked against the bytes left, and fails past the end.
+ */
+class flatReader {
+public:
+    flatReader(const unsigned char *base, size_t size, uint64_t offset) : at {base + std::min<uint64_t>(offset, size)}, end {base + size} {
+        if (offset > size) {
+            corruptData();
+        }
+    }
+
+    template <typename T>
+    T read() {
+        need(sizeof(T));
+        T value {};
+        std::memcpy(&value, at, sizeof value);
+        at += sizeof value;
+        return value;
+    }
+
+    std::string string() {
+        const uint32_t size {read<uint32_t>()};
+        need(size);
+        at += size;
+        return {(const char *)at - size, size};
+    }
+
+    [[nodiscard]] size_t remaining() const {
+        return (size_t)(end - at);
+    }
+
+    /* Fails unless n more bytes are left. */
+    void need(uint64_t n) const {
+        if (n > remaining()) {
+            corruptData();
+        }
+    }
+
+private:
+    const unsigned char *at;
+    const unsigned char *end;
+};
+
+template <typename T>
+void appendValue(std::string &out, T value) {
+    out.append((const char *)&value, sizeof value);
+}
+
+void appendString(std::string &out, const std::string &s) {
+    appendValue(out, (uint32_t)s.size());
+    out += s;
+}
+
+/*
+ * Flat encoding of a program, for the shared cache and snapshots. Slots are
+ * private to a process, so variables are stored by name and interned again
+ * when read; that includes the variable a lowered form binds, which it keeps
+ * in intData. Builtins and forms are stored by index, which the containers
+ * pin down with a format version.
+ */
+void appendProgram(std::string &out, const std::deque<token> &program, const environment &env) {
+    appendValue(out, (uint32_t)program.size());
+
+    for (const token &t: program) {
+        appendValue(out, (uint8_t)t.type);
+        appendValue(out, (uint8_t)(t.unary | t.rAssociative << 1 | (t.body != nullptr) << 2));
+        appendValue(out, (uint32_t)t.argc);
+        appendValue(out, (uint32_t)t.slot);
+        appendValue(out, (int64_t)t.intData);
+        appendValue(out, t.fltData);
+        appendString(out, t.strData);
+
+        /* Forms in function bodies are not lowered yet and have no body. */
+        if (t.body != nullptr) {
+            appendString(out, env.variables[(size_t)t.intData]);
+            appendProgram(out, *t.body, env);
+        }
+    }
+}
+
+/* Bytes appendProgram writes for a token at the least. */
+constexpr size_t flatTokenSize {1 + 1 + 4 + 4 + 8 + 4 + 4};
+
+/*
+ * Whether a decoded token is one a compiled program can hold, with the
+ * operands and the builtin, form, function or parameter it names in range;
+ * params is the parameter count of the function body being read, if any.
+ */
+bool validToken(const token &t, const environment &env, size_t params) {
+    switch (t.type) {
+        case tokenType::add:
+        case tokenType::sub:
+        case tokenType::mul:
+        case tokenType::div:
+        case tokenType::mod:
+        case tokenType::exp:
+        case tokenType::i32:
+        case tokenType::f32:
+        case tokenType::var:
+        case tokenType::lt:
+        case tokenType::gt:
+        case tokenType::le:
+        case tokenType::ge:
+        case tokenType::eq:
+        case tokenType::ne:
+        case tokenType::land:
+        case tokenType::lor:
+        case tokenType::col:
+        case tokenType::img:
+        case tokenType::lbr:
+            return true;
+
+        case tokenType::fun:
+            return t.slot < std::size(builtins) && t.argc == builtins[t.slot].arity;
+
+        /* Only function bodies, which have parameters, hold forms that are not lowered yet; evaluateForm needs the body. */
+        case tokenType::form:
+            return t.slot < std::size(forms) && (t.body != nullptr || params > 0)
+                   && t.argc == forms[t.slot].arity - (t.body != nullptr ? 2 : 0);
+
+        case tokenType::call:
+            return t.slot < env.functions.size() && t.argc == env.functions[t.slot].params.size();
+
+        case tokenType::arg:
+            return t.slot < params;
+
+        default:
+            return false;
+    }
+}
+
+/*
+ * Decodes a program written by appendProgram, failing if it is not one
+ * compile could have produced. New variables are not indexed; call
+ * env.indexVariables afterwards.
+ */
+std::deque<token> readProgram(flatReader &in, environment &env, size_t params = 0, size_t nesting = 0) {
+    if (nesting > maxFormNesting) {
+        corruptData();
+    }
+
+    const uint32_t count {in.read<uint32_t>()};
+    in.need((uint64_t)count * flatTokenSize);
+    std::deque<token> program(count);
+    size_t depth {0};
+
+    for (token &t: program) {
+        t.type = (tokenType)in.read<uint8_t>();
+        const uint8_t flags {in.read<uint8_t>()};
+        t.unary = flags & 1;
+        t.rAssociative = flags & 2;
+        t.argc = in.read<uint32_t>();
+        t.slot = in.read<uint32_t>();
+        t.intData = (long)in.read<int64_t>();
+        t.fltData = in.read<float>();
+        t.strData = in.string();
+
+        if (t.type == tokenType::var) {
+            t.slot = env.intern(t.strData, fnv1a(t.strData));
+        }
+
+        if (flags & 4) {
+            if (t.type != tokenType::form) {
+                corruptData();
+            }
+
+            const std::string variable {in.string()};
+            t.intData = (long)env.intern(variable, fnv1a(variable));
+            t.body = std::make_shared<const std::deque<token>>(readProgram(in, env, params, nesting + 1));
+        }
+
+        /* As in compileParsed, every operator has its operands and one value remains. */
+        if (!validToken(t, env, params) || depth < arity(t)) {
+            corruptData();
+        }
+
+        depth = depth + 1 - arity(t);
+    }
+
+    if (depth != 1) {
+        corruptData();
+    }
+
+    return program;
+}
+
+/*
+ * Compiled programs shared by every process on the host that runs with
+ * --shm-cache, in a POSIX shared memory segment. The segment holds an open
+ * addressing index of (key hash, entry offset) pairs followed by an append
+ * only arena of entries, each a key and its program in a flat encoding with
+ * no pointers, so any process can read it wherever the segment is mapped.
+ *
+ * Nothing is locked. A writer reserves arena space with fetch_add, writes the
+ * entry, claims an index slot by compare-and-swap of its hash and then
+ * publishes the offset with a release store; readers treat a slot whose
+ * offset is still 0 as a miss. The segment starts zeroed, which is a valid
+ * empty cache, so whichever process comes first needs no setup. A full
+ * arena or index just stops taking entries.
+ */
+class sharedCache {
+public:
+    sharedCache(const sharedCache &) = delete;
+    sharedCache &operator=(const sharedCache &) = delete;
+
+    ~sharedCache() {
+        munmap(base, segmentSize);
+    }
+
+    /* Maps the segment, creating it if this is the first process; null if shared memory is unavailable or holds another format. */
+    static std::unique_ptr<sharedCache> attach() {
+        const int fd {shm_open(segmentName, O_CREAT | O_RDWR, 0600)};
+        if (fd < 0) {
+            return nullptr;
+        }
+
+        struct stat info {};
+        const bool sized {fstat(fd, &info) == 0 && ((size_t)info.st_size == segmentSize || ftruncate(fd, segmentSize) == 0)};
+        void *mapped {sized ? mmap(nullptr, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED};
+        close(fd);
+
+        if (mapped == MAP_FAILED) {
+            return nullptr;
+        }
+
+        std::unique_ptr<sharedCache> cache {new sharedCache {(unsigned char *)mapped}};
+
+        uint64_t magic {0};
+        std::atomic_ref<uint64_t> {cache->header()[0]}.compare_exchange_strong(magic, formatMagic);
+        if (magic != 0 && magic != formatMagic) {
+            return nullptr;
+        }
+
+        return cache;
+    }
+
+    /* The program stored under key, with its variables interned into env, or null. */
+    std::shared_ptr<const cachedProgram> find(const std::string &key, environment &env) const {
+        const uint64_t hash {keyHash(key)};
+
+        for (size_t probe {0}; probe < indexSlots; ++probe) {
+            uint64_t *slot {index() + 2 * ((hash + probe) % indexSlots)};
+            const uint64_t claimed {std::atomic_ref<uint64_t> {slot[0]}.load(std::memory_order_acquire)};
+
+            if (claimed == 0) {
+                return nullptr;
+            }
+
+            if (claimed != hash) {
+                continue;
+            }
+
+            const uint64_t offset {std::atomic_ref<uint64_t> {slot[1]}.load(std::memory_order_acquire)};
+            if (offset == 0) {
+                return nullptr;
+            }
+
+            flatReader in {arena(), arenaSize, offset};
+            if (in.string() == key) {
+                std::deque<token> program {readProgram(in, env)};
+                env.indexVariables();
+                return makeCachedProgram(std::move(program), env.mode);
+            }
+        }
+
+        return nullptr;
+    }
+
+    /* Stores program under key, unless the arena or index is full or another process got there first. */
+    void insert(const std::string &key, const std::deque<token> &program, const environment &env) {
+        std::string entry {};
+        appendString(entry, key);
+        appendProgram(entry, program, env);
+
+        const uint64_t size {(entry.size() + 7) & ~7ull};
+        const uint64_t offset {std::atomic_ref<uint64_t> {header()[1]}.fetch_add(size) + 8};
+        if (offset + size > arenaSize) {
+            return;
+        }
+
+        std::memcpy(arena() + offset, entry.data(), entry.size());
+
+        const uint64_t hash {keyHash(key)};
+        for (size_t probe {0}; probe < indexSlots; ++probe) {
+            uint64_t *slot {index() + 2 * ((hash + probe) % indexSlots)};
+            uint64_t claimed {0};
+
+            if (std::atomic_ref<uint64_t> {slot[0]}.compare_exchange_strong(claimed, hash)) {
+                std::atomic_ref<uint64_t> {slot[1]}.store(offset, std::memory_order_release);
+                return;
+            }
+
+            if (claimed == hash) {
+                const uint64_t other {std::atomic_ref<uint64_t> {slot[1]}.load(std::memory_order_acquire)};
+                if (other == 0 || flatReader {arena(), arenaSize, other}.string() == key) {
+                    return;
+                }
+            }
+        }
+    }
+
+private:
+    static constexpr const char *segmentName {"/shunting-yard-programs"};
+    static constexpr uint64_t formatMagic {0x53594350'00000002ull}; // "SYCP", then the format version.
+    static constexpr size_t indexSlots {1 << 16};
+    static constexpr size_t headerSize {64};
+    static constexpr size_t segmentSize {64 << 20};
+    static constexpr size_t arenaSize {segmentSize - headerSize - indexSlots * 16};
+
+    explicit sharedCache(unsigned char *_base) : base {_base} {}
+
+    /* header()[0] is formatMagic, header()[1] the bytes of arena handed out. Offset 0 of the arena is never used, so 0 means unpublished. */
+    uint64_t *header() const { return (uint64_t *)base; }
+    uint64_t *index() const { return (uint64_t *)(base + headerSize); }
+    unsigned char *arena() const { return base + headerSize + indexSlots * 16; }
+
+    /* Never 0, which marks a free slot. */
+    static uint64_t keyHash(const std::string &key) {
+        return mix64(fnv1a(key)) | 1;
+    }
+
+    unsigned char *base;
+};
+
+/*
+ * A saved session: variables with their values in every mode, user
+ * functions, and compiled programs by expression text and by canonical key.
+ * It is read through a read-only mapping. Variables and functions are
+ * restored at startup, but programs stay in the file and are decoded on
+ * their first lookup, through two tables sorted by hash at the end of the
+ * file, so a large cache costs nothing until it is used.
+ *
+ * Layout, in native byte order with 8 byte aligned sections: a header of
+ * 8 words (see the accessors), the variables and functions as flat records,
+ * each distinct program once, then the text and key tables of
+ * (hash, string offset, program offset) records.
+ */
+class snapshot {
+public:
+    snapshot(const snapshot &) = delete;
+    snapshot &operator=(const snapshot &) = delete;
+
+    ~snapshot() {
+        munmap((void *)base, size);
+    }
+
+    /* Maps the snapshot at path; null if there is none yet. A file of another format is an error. */
+    static std::unique_ptr<snapshot> open(const std::string &path) {
+        const int fd {::open(path.c_str(), O_RDONLY)};
+        if (fd < 0) {
+            return nullptr;
+        }
+
+        struct stat info {};
+        void *mapped {fstat(fd, &info) == 0 && (size_t)info.st_size >= headerSize
+                      ? mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED};
+        close(fd);
+
+        if (mapped == MAP_FAILED) {
+            fail("Cannot map snapshot: ", path);
+        }
+
+        std::unique_ptr<snapshot> file {new snapshot {(const unsigned char *)mapped, (size_t)info.st_size}};
+        if (file->word(0) != formatMagic) {
+            fail("Not a snapshot of this version: ", path);
+        }
+
+        /* The tables must fit in the file; their entries are checked as they are read. */
+        for (const size_t table: {4, 6}) {
+            if (file->word(table + 1) > file->size / 24) {
+                corruptData();
+            }
+
+            flatReader {file->base, file->size, file->word(table)}.need(file->word(table + 1) * 24);
+        }
+
+        return file;
+    }
+
+    /* Restores the variables and functions into env, which must be in the mode the snapshot was taken in. */
+    void restore(environment &env) const {
+        if (word(1) != modeWord(env)) {
+            fail("The snapshot was taken in another mode");
+        }
+
+        flatReader in {base, size, headerSize};
+
+        for (uint64_t v {0}; v < word(2); ++v) {
+            const std::string name {in.string()};
+            const size_t slot {env.intern(name, fnv1a(name))};
+            const bool assigned {in.read<uint8_t>() != 0};
+
+            const float value {in.read<float>()};
+            const int64_t units {in.read<int64_t>()};
+            const float re {in.read<float>()};
+            const std::complex<float> z {re, in.read<float>()};
+
+            bigint integer {in.read<int64_t>()};
+            integer.negative = in.read<uint8_t>();
+            const uint32_t limbs {in.read<uint32_t>()};
+            in.need((uint64_t)limbs * sizeof(uint32_t));
+            integer.limbs.resize(limbs);
+            for (uint32_t &limb: integer.limbs) limb = in.read<uint32_t>();
+
+            /* Variables only named by expressions are restored as names, still without a value. */
+            if (assigned) {
+                env.assign(slot, value);
+                env.assign(slot, units);
+                env.assign(slot, z);
+                env.assign(slot, integer);
+            }
+        }
+
+        for (uint64_t f {0}; f < word(3); ++f) {
+            userFunction function {};
+            function.name = in.string();
+            const uint32_t params {in.read<uint32_t>()};
+            in.need((uint64_t)params * sizeof(uint32_t));
+            function.params.resize(params);
+            for (std::string &param: function.params) param = in.string();
+            function.body = readProgram(in, env, params);
+            env.define(function);
+        }
+
+        env.indexVariables();
+    }
+
+    std::shared_ptr<const cachedProgram> findText(const std::string &text, environment &env) const {
+        return find(word(4), word(5), text, env);
+    }
+
+    std::shared_ptr<const cachedProgram> findKey(const std::string &key, environment &env) const {
+        return find(word(6), word(7), key, env);
+    }
+
+    /*
+     * Writes the session to path. Programs of the snapshot env was restored
+     * from are carried over unless env has its own for the same text or key.
+     * The file is replaced by a rename, so a mapping of the old one stays
+     * valid and a crash leaves either snapshot whole.
+     */
+    static void save(const std::string &path, const environment &env) {
+        std::string out(headerSize, '\0');
+
+        for (size_t slot {0}; slot < env.variables.size(); ++slot) {
+            appendString(out, env.variables[slot]);
+            appendValue(out, (uint8_t)env.hasValue(slot));
+            appendValue(out, slot < env.values.size() ? env.values[slot] : NAN);
+            appendValue(out, slot < env.units.size() ? env.units[slot] : (int64_t)0);
+            const std::complex<float> z {slot < env.complexes.size() ? env.complexes[slot] : 0.0f};
+            appendValue(out, z.real());
+            appendValue(out, z.imag());
+
+            const bigint integer {slot < env.integers.size() ? env.integers[slot] : bigint {}};
+            appendValue(out, integer.small);
+            appendValue(out, (uint8_t)integer.negative);
+            appendValue(out, (uint32_t)integer.limbs.size());
+            for (const uint32_t limb: integer.limbs) appendValue(out, limb);
+        }
+
+        for (const userFunction &function: env.functions) {
+            appendString(out, function.name);
+            appendValue(out, (uint32_t)function.params.size());
+            for (const std::string &param: function.params) appendString(out, param);
+            appendProgram(out, function.body, env);
+        }
+
+        /* Each distinct program is written once, after its length, and shared by its texts and key. */
+        std::unordered_map<const cachedProgram *, uint64_t> written {};
+        const auto program {[&](const std::shared_ptr<const cachedProgram> &p) {
+            const auto [at, added] {written.emplace(p.get(), 0)};
+            if (added) {
+                std::string encoded {};
+                appendProgram(encoded, p->compiled, env);
+                at->second = align(out);
+                appendString(out, encoded);
+            }
+            return at->second;
+        }};
+
+        const snapshot *old {env.programs.restored};
+
+        const auto table {[&](const auto &local, uint64_t at, uint64_t count) {
+            std::vector<std::array<uint64_t, 3>> records {};
+
+            for (const auto &[text, p]: local) {
+                if (p == nullptr) continue;
+                const uint64_t programAt {program(p)};
+                const uint64_t textAt {align(out)};
+                appendString(out, text);
+                records.push_back({keyHash(text), textAt, programAt});
+            }
+
+            /* Entries of the old snapshot are copied as they are; a program shared by several keeps one copy per entry. */
+            for (uint64_t r {0}; old != nullptr && r < count; ++r) {
+                const std::array<uint64_t, 3> record {old->record(at, r)};
+                const std::string text {flatReader {old->base, old->size, record[1]}.string()};
+                if (local.count(text) != 0) continue;
+
+                const uint64_t programAt {align(out)};
+                const size_t programSize {old->programSize(record[2])};
+                out.append((const char *)old->base + record[2], programSize);
+                const uint64_t textAt {align(out)};
+                appendString(out, text);
+                records.push_back({record[0], textAt, programAt});
+            }
+
+            std::sort(records.begin(), records.end());
+            const uint64_t tableAt {align(out)};
+            for (const std::array<uint64_t, 3> &r: records) {
+                for (const uint64_t field: r) appendValue(out, field);
+            }
+            return std::pair {tableAt, (uint64_t)records.size()};
+        }};
+
+        const auto [textsAt, texts] {table(env.programs.byText, old ? old->word(4) : 0, old ? old->word(5) : 0)};
+        const auto [keysAt, keys] {table(env.programs.byKey, old ? old->word(6) : 0, old ? old->word(7) : 0)};
+
+        const uint64_t header[] {formatMagic, modeWord(env), env.variables.size(), env.functions.size(), textsAt, texts, keysAt, keys};
+        std::memcpy(out.data(), header, sizeof header);
+
+        const std::string temporary {path + ".tmp"};
+        std::ofstream file {temporary, std::ios::binary | std::ios::trunc};
+        if (!file.write(out.data(), (std::streamsize)out.size()) || !file.flush() || std::rename(temporary.c_str(), path.c_str()) != 0) {
+            fail("Cannot write snapshot: ", path);
+        }
+    }
+
+private:
+    static constexpr uint64_t formatMagic {0x53595353'00000002ull}; // "SYSS", then the format version.
+    static constexpr size_t headerSize {64};
+
+    snapshot(const unsigned char *_base, size_t _size) : base {_base}, size {_size} {}
+
+    /* 0 magic, 1 mode and scale, 2 variables, 3 functions, 4 and 5 offset and count of the text table, 6 and 7 of the key table. */
+    uint64_t word(size_t i) const {
+        return flatReader {base, size, 8 * i}.read<uint64_t>();
+    }
+
+    /* The table's bounds were checked by open. */
+    std::array<uint64_t, 3> record(uint64_t table, uint64_t r) const {
+        flatReader in {base, size, table + 24 * r};
+        return {in.read<uint64_t>(), in.read<uint64_t>(), in.read<uint64_t>()};
+    }
+
+    /* Bytes of the program at offset, with the length in front of it; fails if they run past the end. */
+    size_t programSize(uint64_t offset) const {
+        flatReader in {base, size, offset};
+        const uint32_t length {in.read<uint32_t>()};
+        in.need(length);
+        return sizeof(uint32_t) + length;
+    }
+
+    std::shared_ptr<const cachedProgram> find(uint64_t table, uint64_t count, const std::string &text, environment &env) const {
+        const uint64_t hash {keyHash(text)};
+        uint64_t low {0}, high {count};
+
+        while (low < high) {
+            const uint64_t middle {(low + high) / 2};
+            if (record(table, middle)[0] < hash) {
+                low = middle + 1;
+            }
+            else {
+                high = middle;
+            }
+        }
+
+        for (uint64_t r {low}; r < count && record(table, r)[0] == hash; ++r) {
+            const std::array<uint64_t, 3> found {record(table, r)};
+            if (flatReader {base, size, found[1]}.string() == text) {
+                flatReader in {base, size, found[2]};
+                in.read<uint32_t>();
+                std::deque<token> program {readProgram(in, env)};
+                env.indexVariables();
+                return makeCachedProgram(std::move(program), env.mode);
+            }
+        }
+
+        return nullptr;
+    }
+
+    static uint64_t keyHash(const std::string &text) {
+        return mix64(fnv1a(text));
+    }
+
+    static uint64_t modeWord(const environment &env) {
+        return (uint64_t)env.mode << 32 | (uint32_t)env.scale;
+    }
+
+    /* Pads out to a multiple of 8 and returns the new size. */
+    static uint64_t align(std::string &out) {
+        out.resize((out.size() + 7) & ~(size_t)7, '\0');
+        return out.size();
+    }
+
+    const unsigned char *base;
+    size_t size;
+};
+
+/* Entries kept by compileCached before it starts over. */
+constexpr size_t maxCachedPrograms {1 << 16};
+
+/*
+ * compile through the environment's program cache. The exact text is looked
+ * up first, which skips lexing altogether; otherwise the expression is
+ * parsed and looked up by canonicalKey. Each map is backed by the restored
+ * snapshot, if any, and the key also by the shared cache; only a miss in all
+ * of them runs the remaining passes. Programs that call
+ * user functions stay out of the shared cache, since other processes may
+ * define them differently. Returns null for an empty expression.
+ */
+std::shared_ptr<const cachedProgram> compileCached(lexana &lexer, const std::string &exprStr) {
+    programCache &cache {lexer.getEnvironment().programs};
+
+    if (const auto hit {cache.byText.find(exprStr)}; hit != cache.byText.end()) {
+        return hit->second;
+    }
+
+    if (cache.restored != nullptr) {
+        if (std::shared_ptr<const cachedProgram> program {cache.restored->findText(exprStr, lexer.getEnvironment())}) {
+            return cache.byText[exprStr] = program;
+        }
+    }
+
+    lexer.lex(exprStr);
+    const std::deque<token> formatted {shuntingYard(lexer.getTokens())};
+    lexer.getTokens().clear();
+
+    if (formatted.empty()) {
+        return nullptr;
+    }
+
+    if (cache.byText.size() >= maxCachedPrograms) {
+        cache.clear();
+    }
+
+    const std::string key {canonicalKey(formatted)};
+    std::shared_ptr<const cachedProgram> &program {cache.byKey[key]};
+
+    if (program == nullptr) {
+        environment &env {lexer.getEnvironment()};
+        const bool shareable {cache.shared != nullptr && std::none_of(formatted.begin(), formatted.end(), [](const token &t) {
+            return t.type == tokenType::call;
+        })};
+        const std::string sharedKey {shareable ? std::to_string((int)env.mode) + ':' + std::to_string(env.scale) + ' ' + key : ""};
+
+        if (cache.restored != nullptr) {
+            program = cache.restored->findKey(key, env);
+        }
+
+        if (program == nullptr && shareable) {
+            program = cache.shared->find(sharedKey, env);
+        }
+
+        if (program == nullptr) {
+            std::deque<token> compiled {compileParsed(env, formatted)};
+            if (compiled.empty()) {
+                cache.byKey.erase(key);
+                return nullptr;
+            }
+
+            program = makeCachedProgram(std::move(compiled), env.mode);
+
+            if (shareable) {
+                cache.shared->insert(sharedKey, program->compiled, env);
+            }
+        }
+    }
+
+    cache.byText[exprStr] = program;
+    return program;
+}
+
+/* Position of a definition's '=' in line, or npos if the line is a plain expression. */
+size_t findAssignment(const std::string &line) {
+    const size_t pos {line.find('=')};
+
+    if (pos == std::string::npos || pos == 0 || line[pos + 1] == '='
+        || line[pos - 1] == '<' || line[pos - 1] == '>' || line[pos - 1] == '!') {
+        return std::string::npos;
+    }
+
+    return pos;
+}
+
+/*
+ * Handles "name = expr" (assigns a variable) and "name(a, b) = expr" (defines
+ * a function, compiled once here and inlined into every caller). Returns
+ * false if the line is not a definition.
+ */
+bool define(lexana &lexer, const std::string &line) {
+    const size_t eq {findAssignment(line)};
+    if (eq == std::string::npos) {
+        return false;
+    }
+
+    environment &env {lexer.getEnvironment()};
+    const std::string head {line.substr(0, eq)};
+    size_t i {0};
+
+    const auto skipSpace {[&] {
+        while (i < head.size() && (head[i] == ' ' || head[i] == '\t')) ++i;
+    }};
+
+    const auto name {[&] {
+        const size_t start {i};
+        while (i < head.size() && (std::isalnum((unsigned char)head[i]) || head[i] == '_')) ++i;
+        return head.substr(start, i - start);
+    }};
+
+    const auto malformed {[&] {
+        fail("Malformed definition: ", head);
+    }};
+
+    skipSpace();
+    const std::string target {name()};
+    if (target.empty() || !std::isalpha((unsigned char)target[0])) malformed();
+    skipSpace();
+
+    const bool isFunction {i < head.size() && head[i] == '('};
+    std::vector<std::string> params {};
+
+    if (isFunction) {
+        ++i;
+        skipSpace();
+
+        while (i < head.size() && head[i] != ')') {
+            params.push_back(name());
+            if (params.back().empty()) malformed();
+            skipSpace();
+
+            if (i < head.size() && head[i] == ',') {
+                ++i;
+                skipSpace();
+            }
+        }
+
+        if (i == head.size()) malformed();
+        ++i;
+        skipSpace();
+    }
+
+    if (i != head.size()) malformed();
+
+    const std::string body {line.substr(eq + 1)};
+
+    if (!isFunction) {
+        const std::deque<token> formatted {compile(lexer, body)};
+        if (formatted.empty()) {
+            fail("Empty expression");
+        }
+
+        if (containsArray(formatted)) {
+            fail("Variables hold scalars, not arrays");
+        }
+
+        checkAssigned(formatted, env);
+
+        if (env.mode == evalMode::decimal) {
+            env.assign(env.intern(target), computeDecimal(lowerBranches(formatted), env.scale, env.units));
+        }
+        else if (env.mode == evalMode::bignum) {
+            env.assign(env.intern(target), computeBig(lowerBranches(formatted), env.integers));
+        }
+        else if (env.mode == evalMode::complex) {
+            env.assign(env.intern(target), computeComplex(lowerBranches(formatted), env.complexes));
+        }
+        else {
+            env.assign(env.intern(target), compute(lowerBranches(formatted), env.values));
+        }
+        return true;
+    }
+
+    if (findBuiltin(target) >= 0) {
+        fail("Cannot redefine builtin: ", target);
+    }
+
+    userFunction f {};
+    f.name = target;
+    f.params = params;
+    f.body = compile(lexer, body, f.params);
+
+    if (f.body.empty()) {
+        fail("Empty function body: ", f.name);
+    }
+
+    env.define(f);
+    return true;
+}
+
+/* Set on the threads of the parallelFor pool, so that nested loops run inline instead of multiplying threads. */
+thread_local bool insideParallelFor {false};
+
+/* Threads kept for parallelFor, started on first use; each runs queued work in order of arrival. */
+class threadPool {
+public:
+    explicit threadPool(size_t threads) {
+        for (size_t t {0}; t < threads; ++t) {
+            workers.emplace_back([this] {
+                insideParallelFor = true;
+                work();
+            });
+        }
+    }
+
+    threadPool(const threadPool &) = delete;
+    threadPool &operator=(const threadPool &) = delete;
+
+    ~threadPool() {
+        {
+            const std::lock_guard lock {mutex};
+            stopping = true;
+        }
+
+        ready.notify_all();
+        for (std::thread &t: workers) {
+            t.join();
+        }
+    }
+
+    /* One fewer than the hardware threads, as the thread calling parallelFor works too. */
+    static threadPool &shared() {
+        static threadPool pool {std::max(1u, std::thread::hardware_concurrency()) - 1};
+        return pool;
+    }
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    void post(std::function<void()> fn) {
+        {
+            const std::lock_guard lock {mutex};
+            queue.push_back(std::move(fn));
+        }
+
+        ready.notify_one();
+    }
+
+private:
+    void work() {
+        while (true) {
+            std::unique_lock lock {mutex};
+            ready.wait(lock, [this] { return stopping || !queue.empty(); });
+
+            if (queue.empty()) {
+                return;
+            }
+
+            std::function<void()> fn {std::move(queue.front())};
+            queue.pop_front();
+            lock.unlock();
+            fn();
+        }
+    }
+
+    std::mutex mutex {};
+    std::condition_variable ready {};
+    std::deque<std::function<void()>> queue {};
+    std::vector<std::thread> workers {};
+    bool stopping {false};
+};
+
+/*
+ * Runs fn(i) for every i in [0, n) on the calling thread and the threads of
+ * threadPool::shared. Which thread gets which i varies from run to run, so
+ * callers make each result depend on i alone and combine results in index
+ * order. If fn throws, the remaining indices are skipped and the first
+ * exception is rethrown to the caller.
+ *
+ * Helpers queued behind other work may start only after the caller has
+ * finished every index; closed tells them to return without touching fn,
+ * so the caller waits just for the helpers already running.
+ */
+template <typename F>
+void parallelFor(size_t n, F fn) {
+    struct job {
+        std::atomic<size_t> next {0};
+        std::exception_ptr error {};
+        std::mutex mutex {};
+        std::condition_variable idle {};
+        size_t running {0};
+        bool closed {false};
+    };
+
+    const auto state {std::make_shared<job>()};
+
+    const auto worker {[&fn, n, &state = *state] {
+        try {
+            for (size_t i {state.next++}; i < n; i = state.next++) {
+                fn(i);
+            }
+        }
+        catch (...) {
+            state.next = n;
+            const std::lock_guard lock {state.mutex};
+            if (state.error == nullptr) state.error = std::current_exception();
+        }
+    }};
+
+    threadPool &pool {threadPool::shared()};
+    const size_t helpers {insideParallelFor || n < 2 ? 0 : std::min(n - 1, pool.size())};
+    const cancellation *token {activeCancellation};
+
+    for (size_t h {0}; h < helpers; ++h) {
+        pool.post([state, &worker, token] {
+            {
+                const std::lock_guard lock {state->mutex};
+                if (state->closed) return;
+                ++state->running;
+            }
+
+            activeCancellation = token;
+            worker();
+            activeCancellation = nullptr;
+
+            const std::lock_guard lock {state->mutex};
+            --state->running;
+            state->idle.notify_all();
+        });
+    }
+
+    /* The calling thread works too; it only counts as nested while it does. */
+    const bool outer {insideParallelFor};
+    insideParallelFor = true;
+    worker();
+    insideParallelFor = outer;
+
+    std::unique_lock lock {state->mutex};
+    state->closed = true;
+    state->idle.wait(lock, [&] { return state->running == 0; });
+
+    if (state->error != nullptr) {
+        std::rethrow_exception(state->error);
+    }
+}
+
+/* Deepest the evaluation stack gets while running the program. */
+size_t stackDepth(const std::deque<token> &formatted) {
+    size_t depth {0}, deepest {0};
+
+    for (const token &t: formatted) {
+        switch (t.type) {
+            case tokenType::i32:
+            case tokenType::f32:
+            case tokenType::var:
+                ++depth;
+                break;
+
+            default:
+                depth = depth + 1 - arity(t);
+                break;
+        }
+
+        deepest = std::max(deepest, depth);
+    }
+
+    return deepest;
+}
+
+/* Rows per tile in batch mode; a multiple of vlanes so kernels never need a scalar tail. */
+constexpr size_t tileSize {256};
+
+/*
+ * Runs the program over one tile of rows; vars[slot] points at this tile's
+ * values of variable slot. stack must hold stackDepth tiles. Returns the
+ * result tile. approx selects the approximate kernels for ^ and builtins.
+ */
+const float *runTile(const std::deque<token> &formatted, float *stack, const std::vector<const float *> &vars, size_t rows,
+                     bool approx = false) {
+    checkCancelled();
+    float *top {stack};
+
+    for (const token &t: formatted) {
+        switch (t.type) {
+            case tokenType::i32:
+                std::fill_n(top, tileSize, (float)t.intData);
+                top += tileSize;
+                break;
+
+            case tokenType::f32:
+                std::fill_n(top, tileSize, t.fltData);
+                top += tileSize;
+                break;
+
+            case tokenType::var:
+                std::copy_n(vars[t.slot], rows, top);
+                top += tileSize;
+                break;
+
+            case tokenType::fun: {
+                float *args {top - t.argc * tileSize};
+                const builtin &f {builtins[t.slot]};
+                (approx && f.approx != nullptr ? f.approx : f.batch)(args, args + tileSize, tileSize);
+                top = args + tileSize;
+                break;
+            }
+
+            case tokenType::col: {
+                top -= 2 * tileSize;
+                batchSelect(top - tileSize, top, top + tileSize, tileSize);
+                break;
+            }
+
+            /* Forms run once per row; each run batches its own subprogram. Columns without values bind to NaN. */
+            case tokenType::form: {
+                float *operands {top - t.argc * tileSize};
+                std::vector<float> bindings(vars.size()), row(t.argc);
+
+                for (size_t r {0}; r < rows; ++r) {
+                    for (size_t c {0}; c < vars.size(); ++c) {
+                        bindings[c] = vars[c] != nullptr ? vars[c][r] : NAN;
+                    }
+                    for (size_t a {0}; a < t.argc; ++a) {
+                        row[a] = operands[a * tileSize + r];
+                    }
+
+                    operands[r] = evaluateForm(t, row.data(), bindings);
+                }
+
+                top = operands + tileSize;
+                break;
+            }
+
+            case tokenType::add:
+            case tokenType::sub:
+            case tokenType::mul:
+            case tokenType::div:
+            case tokenType::mod:
+            case tokenType::exp:
+            case tokenType::lt:
+            case tokenType::gt:
+            case tokenType::le:
+            case tokenType::ge:
+            case tokenType::eq:
+            case tokenType::ne:
+            case tokenType::land:
+            case tokenType::lor: {
+                if (t.unary) {
+                    float *rhs {top - tileSize};
+                    for (size_t k {0}; k < tileSize; ++k) rhs[k] = -rhs[k];
+                    break;
+                }
+
+                top -= tileSize;
+                const float *rhs {top};
+                float *lhs {top - tileSize};
+
+                switch (t.type) {
+                    case tokenType::exp:
+                        if (approx) {
+                            batchPowApprox(lhs, rhs, tileSize);
+                            break;
+                        }
+
+                        for (size_t k {0}; k < tileSize; ++k) lhs[k] = std::pow(lhs[k], rhs[k]);
+                        break;
+
+                    case tokenType::mul:
+                        for (size_t k {0}; k < tileSize; ++k) lhs[k] *= rhs[k];
+                        break;
+
+                    case tokenType::div:
+                        for (size_t k {0}; k < tileSize; ++k) lhs[k] /= rhs[k];
+                        break;
+
+                    case tokenType::mod:
+                        for (size_t k {0}; k < tileSize; ++k) lhs[k] = std::fmod(lhs[k], rhs[k]);
+                        break;
+
+                    case tokenType::add:
+                        for (size_t k {0}; k < tileSize; ++k) lhs[k] += rhs[k];
+                        break;
+
+                    case tokenType::sub:
+                        for (size_t k {0}; k < tileSize; ++k) lhs[k] -= rhs[k];
+                        break;
+
+                    case tokenType::lt:
+                        for (size_t k {0}; k < tileSize; ++k) lhs[k] = lhs[k] < rhs[k];
+                        break;
+
+                    case tokenType::gt:
+                        for (size_t k {0}; k < tileSize; ++k) lhs[k] = lhs[k] > rhs[k];
+                        break;
+
+                    case tokenType::le:
+                        for (size_t k {0}; k < tileSize; ++k) lhs[k] = lhs[k] <= rhs[k];
+                        break;
+
+                    case tokenType::ge:
+                        for (size_t k {0}; k < tileSize; ++k) lhs[k] = lhs[k] >= rhs[k];
+                        break;
+
+                    case tokenType::eq:
+                        for (size_t k {0}; k < tileSize; ++k) lhs[k] = lhs[k] == rhs[k];
+                        break;
+
+                    case tokenType::ne:
+                        for (size_t k {0}; k < tileSize; ++k) lhs[k] = lhs[k] != rhs[k];
+                        break;
+
+                    case tokenType::land:
+                        for (size_t k {0}; k < tileSize; ++k) lhs[k] = (lhs[k] != 0.0f) & (rhs[k] != 0.0f);
+                        break;
+
+                    case tokenType::lor:
+                        for (size_t k {0}; k < tileSize; ++k) lhs[k] = (lhs[k] != 0.0f) | (rhs[k] != 0.0f);
+                        break;
+
+                    default: break;
+                }
+                break;
+            }
+
+            default: break;
+        }
+    }
+
+    return top - tileSize;
+}
+
+/* Every variable the program reads must have a column, and random variables their samples. */
+void checkColumns(const std::deque<token> &formatted, size_t columns) {
+    for (const token &t: formatted) {
+        if (t.type == tokenType::var && t.slot >= columns) {
+            fail("Unbound variable: ", t.strData);
+        }
+
+        if (t.type == tokenType::fun && builtins[t.slot].random && t.argc != builtins[t.slot].arity + 1) {
+            fail("Random variables in batches need --montecarlo: ", t.strData);
+        }
+    }
+}
+
+/*
+ * Batch mode: evaluates the program once per row, where columns[slot] holds
+ * the values of variable slot for every row. Rows are processed a tile at a
+ * time so every operator is a tight loop over tileSize floats.
+ */
+std::vector<float> computeBatch(const std::deque<token> &formatted, const std::vector<const float *> &columns, size_t count,
+                                bool approx = false) {
+    checkColumns(formatted, columns.size());
+
+    std::vector<float> results(count);
+    std::vector<float> stack(std::max<size_t>(stackDepth(formatted), 1) * tileSize);
+    std::vector<const float *> vars(columns.size());
+
+    for (size_t base {0}; base < count; base += tileSize) {
+        const size_t rows {std::min(tileSize, count - base)};
+
+        for (size_t c {0}; c < columns.size(); ++c) {
+            vars[c] = columns[c] != nullptr ? columns[c] + base : nullptr;
+        }
+
+        std::copy_n(runTile(formatted, stack.data(), vars, rows, approx), rows, results.begin() + base);
+    }
+
+    return results;
+}
+
+/*
+ * Evaluates body at n points of the variable in slot variable, with every
+ * other variable fixed at its binding. Tiles of points are spread over
+ * threads.
+ */
+void evaluatePoints(const std::deque<token> &body, size_t variable, const std::vector<float> &bindings,
+                    const float *points, float *out, size_t n) {
+    checkColumns(body, bindings.size());
+
+    std::vector<float> constants(bindings.size() * tileSize);
+    for (size_t c {0}; c < bindings.size(); ++c) {
+        std::fill_n(constants.begin() + (long)(c * tileSize), tileSize, bindings[c]);
+    }
+
+    const size_t depth {std::max<size_t>(stackDepth(body), 1)};
+    parallelFor((n + tileSize - 1) / tileSize, [&](size_t tile) {
+        const size_t base {tile * tileSize};
+        const size_t rows {std::min(tileSize, n - base)};
+
+        std::vector<float> stack(depth * tileSize);
+        std::vector<const float *> vars(bindings.size());
+        for (size_t c {0}; c < vars.size(); ++c) {
+            vars[c] = c == variable ? points + base : constants.data() + c * tileSize;
+        }
+
+        std::copy_n(runTile(body, stack.data(), vars, rows), rows, out + base);
+    });
+}
+
+/* Nodes and weights of the 15 point Gauss-Kronrod rule on [-1, 1] (QUADPACK qk15); the odd nodes carry the 7 point Gauss rule. */
+static const double kronrodNodes[8] {
+    0.991455371120812639206854697526329, 0.949107912342758524526189684047851, 0.864864423359769072789712788640926,
+    0.741531185599394439863864773280788, 0.586087235467691130294144845693013, 0.405845151377397166906606412076961,
+    0.207784955007898467600689403773245, 0.0
+};
+
+static const double kronrodWeights[8] {
+    0.022935322010529224963732008058970, 0.063092092629978553290700663189204, 0.104790010322250183839876322541518,
+    0.140653259715525918745189590510238, 0.169004726639267902826583426598550, 0.190350578064785409913256402421014,
+    0.204432940075298892414161999234649, 0.209482141084727828012999174891714
+};
+
+static const double gaussWeights[4] {
+    0.129484966168869693270611432679082, 0.279705391489276667901467771423780, 0.381830050505118944950369775488975,
+    0.417959183673469387755102040816327
+};
+
+/* Refinement stops at this many subintervals even if the error estimate never gets below tolerance. */
+constexpr size_t maxIntervals {1 << 16};
+
+class quadInterval {
+public:
+    double lo {};
+    double hi {};
+    double value {};
+    double error {};
+};
+
+/*
+ * integrate(expr, x, a, b): adaptive Gauss-Kronrod quadrature in rounds.
+ * Every round evaluates the 15 nodes of all unfinished subintervals in one
+ * batch, keeps those whose error estimate is within their share of the
+ * tolerance and bisects the rest. The tolerance is 1e-6 relative, which is
+ * about what float evaluation of the integrand allows.
+ */
+float integrate(const token &t, float a, float b, std::vector<float> bindings) {
+    const size_t variable {(size_t)t.intData};
+    if (variable >= bindings.size()) {
+        bindings.resize(variable + 1);
+    }
+
+    std::vector<quadInterval> pending {{a, b}};
+    std::vector<float> points {}, values {};
+    double value {0.0}, error {0.0};
+
+    while (!pending.empty()) {
+        points.resize(pending.size() * 15);
+        values.resize(points.size());
+
+        for (size_t i {0}; i < pending.size(); ++i) {
+            const double center {(pending[i].lo + pending[i].hi) / 2.0};
+            const double half {(pending[i].hi - pending[i].lo) / 2.0};
+
+            for (size_t j {0}; j < 7; ++j) {
+                points[i * 15 + 2 * j] = (float)(center - half * kronrodNodes[j]);
+                points[i * 15 + 2 * j + 1] = (float)(center + half * kronrodNodes[j]);
+            }
+            points[i * 15 + 14] = (float)center;
+        }
+
+        evaluatePoints(*t.body, variable, bindings, points.data(), values.data(), points.size());
+
+        double pendingValue {0.0}, pendingError {0.0};
+        for (size_t i {0}; i < pending.size(); ++i) {
+            const float *f {values.data() + i * 15};
+            double kronrod {kronrodWeights[7] * f[14]};
+            double gauss {gaussWeights[3] * f[14]};
+
+            for (size_t j {0}; j < 7; ++j) {
+                const double pair {(double)f[2 * j] + f[2 * j + 1]};
+                kronrod += kronrodWeights[j] * pair;
+                if (j % 2 == 1) gauss += gaussWeights[j / 2] * pair;
+            }
+
+            const double half {(pending[i].hi - pending[i].lo) / 2.0};
+            pending[i].value = kronrod * half;
+            pending[i].error = std::fabs((kronrod - gauss) * half);
+            pendingValue += pending[i].value;
+            pendingError += pending[i].error;
+        }
+
+        const double tolerance {std::max(1e-6 * std::fabs(value + pendingValue), 1e-12)};
+        if (error + pendingError <= tolerance || std::isnan(pendingError)
+            || 2 * pending.size() > maxIntervals) {
+            value += pendingValue;
+            error += pendingError;
+            break;
+        }
+
+        std::vector<quadInterval> next {};
+        for (const quadInterval &interval: pending) {
+            const double share {tolerance * std::fabs((interval.hi - interval.lo) / ((double)b - a))};
+
+            if (interval.error <= share) {
+                value += interval.value;
+                error += interval.error;
+                continue;
+            }
+
+            const double middle {(interval.lo + interval.hi) / 2.0};
+            next.push_back({interval.lo, middle});
+            next.push_back({middle, interval.hi});
+        }
+
+        pending = std::move(next);
+    }
+
+    return (float)value;
+}
+
+/* Terms per unit of work in sum and prod; fixed so that the rounding of the result does not depend on the thread count. */
+constexpr size_t seriesChunk {64 * tileSize};
+
+/*
+ * sum(i, lo, hi, expr) and prod(i, lo, hi, expr) over the integers i from
+ * ceil(lo) to floor(hi), as a parallel reduction: each chunk of terms is
+ * evaluated a tile at a time and accumulated in double, and the chunk
+ * results are combined in order. i is passed to expr as a float, which
+ * counts exactly only 2^24 steps, so longer ranges fail, as do infinite or
+ * NaN bounds.
+ */
+float series(const token &t, float lo, float hi, std::vector<float> bindings, bool product) {
+    const size_t variable {(size_t)t.intData};
+    if (variable >= bindings.size()) {
+        bindings.resize(variable + 1);
+    }
+
+    const char *name {product ? "prod" : "sum"};
+    if (!std::isfinite(lo) || !std::isfinite(hi)) {
+        fail("Bounds of ", name, " must be finite");
+    }
+
+    const double first {std::ceil((double)lo)}, last {std::floor((double)hi)};
+    if (last - first >= (double)(1 << 24)) {
+        fail(name, " over more than 2^24 terms");
+    }
+
+    if (!(first <= last)) {
+        return product ? 1.0f : 0.0f;
+    }
+
+    const std::deque<token> &body {*t.body};
+    checkColumns(body, bindings.size());
+
+    std::vector<float> constants(bindings.size() * tileSize);
+    for (size_t c {0}; c < bindings.size(); ++c) {
+        std::fill_n(constants.begin() + (long)(c * tileSize), tileSize, bindings[c]);
+    }
+
+    const size_t count {(size_t)(last - first) + 1};
+    const size_t depth {std::max<size_t>(stackDepth(body), 1)};
+    std::vector<double> partials((count + seriesChunk - 1) / seriesChunk);
+
+    parallelFor(partials.size(), [&](size_t chunk) {
+        std::vector<float> stack(depth * tileSize), points(tileSize);
+        std::vector<const float *> vars(bindings.size());
+        for (size_t c {0}; c < vars.size(); ++c) {
+            vars[c] = c == variable ? points.data() : constants.data() + c * tileSize;
+        }
+
+        double partial {product ? 1.0 : 0.0};
+        const size_t end {std::min(count, (chunk + 1) * seriesChunk)};
+
+        for (size_t base {chunk * seriesChunk}; base < end; base += tileSize) {
+            const size_t rows {std::min(tileSize, end - base)};
+            for (size_t r {0}; r < rows; ++r) {
+                points[r] = (float)(first + (double)(base + r));
+            }
+
+            const float *terms {runTile(body, stack.data(), vars, rows)};
+            for (size_t r {0}; r < rows; ++r) {
+                partial = product ? partial * terms[r] : partial + terms[r];
+            }
+        }
+
+        partials[chunk] = partial;
+    });
+
+    double result {product ? 1.0 : 0.0};
+    for (const double partial: partials) {
+        result = product ? result * partial : result + partial;
+    }
+
+    return (float)result;
+}
+
+/* Forward-mode automatic differentiation: a value and its derivative with respect to one variable. */
+class dual {
+public:
+    double value {};
+    double derivative {};
+};
+
+/* Programs computeDual can differentiate: anything without nested forms. */
+bool differentiable(const std::deque<token> &formatted) {
+    return std::none_of(formatted.begin(), formatted.end(), [](const token &t) { return t.type == tokenType::form; });
+}
+
+/* Evaluates the program in double at x for the variable in slot variable, carrying the derivative along. */
+dual computeDual(const std::deque<token> &formatted, const std::vector<float> &bindings, size_t variable, double x) {
+    std::vector<dual> stack {};
+
+    for (const token &t: formatted) {
+        switch (t.type) {
+            case tokenType::i32:
+                stack.push_back({(double)t.intData, 0.0});
+                break;
+
+            case tokenType::f32:
+                stack.push_back({t.fltData, 0.0});
+                break;
+
+            case tokenType::var:
+                if (t.slot == variable) {
+                    stack.push_back({x, 1.0});
+                    break;
+                }
+
+                if (t.slot >= bindings.size()) {
+                    fail("Unbound variable: ", t.strData);
+                }
+
+                stack.push_back({bindings[t.slot], 0.0});
+                break;
+
+            case tokenType::fun: {
+                dual &a {stack[stack.size() - t.argc]};
+                const dual b {t.argc == 2 ? stack.back() : dual {}};
+
+                switch ((builtinSlot)t.slot) {
+                    case builtinSlot::sqrt: a = {std::sqrt(a.value), a.derivative / (2.0 * std::sqrt(a.value))}; break;
+                    case builtinSlot::abs: a = {std::fabs(a.value), a.value < 0.0 ? -a.derivative : a.derivative}; break;
+                    case builtinSlot::exp: a = {std::exp(a.value), std::exp(a.value) * a.derivative}; break;
+                    case builtinSlot::log: a = {std::log(a.value), a.derivative / a.value}; break;
+                    case builtinSlot::sin: a = {std::sin(a.value), std::cos(a.value) * a.derivative}; break;
+                    case builtinSlot::cos: a = {std::cos(a.value), -std::sin(a.value) * a.derivative}; break;
+                    case builtinSlot::floor: a = {std::floor(a.value), 0.0}; break;
+                    case builtinSlot::min: a = b.value < a.value ? b : a; break;
+                    case builtinSlot::max: a = b.value > a.value ? b : a; break;
+                    default: break;
+                }
+
+                stack.resize(stack.size() - t.argc + 1);
+                break;
+            }
+
+            case tokenType::col: {
+                const dual otherwise {stack.back()};
+                stack.pop_back();
+                const dual then {stack.back()};
+                stack.pop_back();
+                stack.back() = stack.back().value != 0.0 ? then : otherwise;
+                break;
+            }
+
+            case tokenType::add:
+            case tokenType::sub:
+            case tokenType::mul:
+            case tokenType::div:
+            case tokenType::mod:
+            case tokenType::exp:
+            case tokenType::lt:
+            case tokenType::gt:
+            case tokenType::le:
+            case tokenType::ge:
+            case tokenType::eq:
+            case tokenType::ne:
+            case tokenType::land:
+            case tokenType::lor: {
+                if (t.unary) {
+                    stack.back() = {-stack.back().value, -stack.back().derivative};
+                    break;
+                }
+
+                const dual b {stack.back()};
+                stack.pop_back();
+                dual &a {stack.back()};
+
+                switch (t.type) {
+                    case tokenType::add: a = {a.value + b.value, a.derivative + b.derivative}; break;
+                    case tokenType::sub: a = {a.value - b.value, a.derivative - b.derivative}; break;
+                    case tokenType::mul: a = {a.value * b.value, a.derivative * b.value + a.value * b.derivative}; break;
+
+                    case tokenType::div:
+                        a = {a.value / b.value, (a.derivative * b.value - a.value * b.derivative) / (b.value * b.value)};
+                        break;
+
+                    case tokenType::mod: {
+                        const double quotient {std::trunc(a.value / b.value)};
+                        a = {std::fmod(a.value, b.value), a.derivative - quotient * b.derivative};
+                        break;
+                    }
+
+                    /* With a constant exponent this avoids log a, which is NaN for negative bases. */
+                    case tokenType::exp: {
+                        const double power {std::pow(a.value, b.value)};
+                        const double slope {b.derivative == 0.0
+                                            ? b.value * std::pow(a.value, b.value - 1.0) * a.derivative
+                                            : power * (b.derivative * std::log(a.value) + b.value * a.derivative / a.value)};
+                        a = {power, slope};
+                        break;
+                    }
+
+                    case tokenType::lt: a = {(double)(a.value < b.value), 0.0}; break;
+                    case tokenType::gt: a = {(double)(a.value > b.value), 0.0}; break;
+                    case tokenType::le: a = {(double)(a.value <= b.value), 0.0}; break;
+                    case tokenType::ge: a = {(double)(a.value >= b.value), 0.0}; break;
+                    case tokenType::eq: a = {(double)(a.value == b.value), 0.0}; break;
+                    case tokenType::ne: a = {(double)(a.value != b.value), 0.0}; break;
+                    case tokenType::land: a = {(double)(a.value != 0.0 && b.value != 0.0), 0.0}; break;
+                    case tokenType::lor: a = {(double)(a.value != 0.0 || b.value != 0.0), 0.0}; break;
+                    default: break;
+                }
+                break;
+            }
+
+            default: break;
+        }
+    }
+
+    return stack.back();
+}
+
+/* Iteration limit of solve; both methods normally converge in well under 60. */
+constexpr size_t maxSolveIterations {100};
+
+/*
+ * solve(expr, x, lo, hi): a root of expr in [lo, hi], which must bracket a
+ * sign change; otherwise the result is NaN. The compiled subprogram is
+ * evaluated directly at every step. When it can be differentiated with dual
+ * numbers, Newton steps are taken and fall back to bisection whenever they
+ * would leave the bracket or shrink it too slowly. Otherwise Brent's method
+ * combines bisection with secant and inverse quadratic interpolation.
+ */
+float solve(const token &t, float lo, float hi, std::vector<float> bindings) {
+    const size_t variable {(size_t)t.intData};
+    if (variable >= bindings.size()) {
+        bindings.resize(variable + 1);
+    }
+
+    const std::deque<token> &body {*t.body};
+    const bool newton {differentiable(body)};
+    const std::deque<token> scalar {newton ? std::deque<token> {} : fuse(lowerBranches(body))};
+
+    const auto f {[&](double x) {
+        if (newton) {
+            return computeDual(body, bindings, variable, x).value;
+        }
+
+        bindings[variable] = (float)x;
+        return (double)compute(scalar, bindings);
+    }};
+
+    double a {lo}, b {hi};
+    double fa {f(a)}, fb {f(b)};
+    if (fa == 0.0) return (float)a;
+    if (fb == 0.0) return (float)b;
+    if (!(fa * fb < 0.0)) {
+        return NAN;
+    }
+
+    const auto converged {[](double x, double width) {
+        return std::fabs(width) <= 4.0 * std::numeric_limits<float>::epsilon() * std::fabs(x) + 1e-30;
+    }};
+
+    if (newton) {
+        /* Keep f(a) < 0 < f(b), and step from the middle. */
+        if (fa > 0.0) std::swap(a, b);
+        double x {(a + b) / 2.0}, step {b - a}, previous {step};
+
+        for (size_t i {0}; i < maxSolveIterations; ++i) {
+            const dual fx {computeDual(body, bindings, variable, x)};
+            if (fx.value == 0.0) break;
+            (fx.value < 0.0 ? a : b) = x;
+
+            const double target {x - fx.value / fx.derivative};
+            const bool inside {(target - a) * (target - b) < 0.0};
+
+            if (inside && std::fabs(2.0 * fx.value) <= std::fabs(previous * fx.derivative)) {
+                previous = step;
+                step = target - x;
+                x = target;
+            }
+            else {
+                previous = step;
+                step = (b - a) / 2.0;
+                x = a + step;
+            }
+
+            if (converged(x, step)) break;
+        }
+
+        return (float)x;
+    }
+
+    /* Brent's zeroin: b is the best estimate, [b, c] brackets the root, a is the previous b. */
+    double c {a}, fc {fa}, d {b - a}, e {d};
+
+    for (size_t i {0}; i < maxSolveIterations; ++i) {
+        if ((fb > 0.0) == (fc > 0.0)) {
+            c = a;
+            fc = fa;
+            d = e = b - a;
+        }
+
+        if (std::fabs(fc) < std::fabs(fb)) {
+            a = b; b = c; c = a;
+            fa = fb; fb = fc; fc = fa;
+        }
+
+        const double tolerance {2.0 * std::numeric_limits<float>::epsilon() * std::fabs(b) + 1e-30};
+        const double middle {(c - b) / 2.0};
+        if (std::fabs(middle) <= tolerance || fb == 0.0) {
+            break;
+        }
+
+        if (std::fabs(e) >= tolerance && std::fabs(fa) > std::fabs(fb)) {
+            double p, q;
+            const double s {fb / fa};
+
+            if (a == c) {
+                p = 2.0 * middle * s;
+                q = 1.0 - s;
+            }
+            else {
+                const double r {fb / fc}, qa {fa / fc};
+                p = s * (2.0 * middle * qa * (qa - r) - (b - a) * (r - 1.0));
+                q = (qa - 1.0) * (r - 1.0) * (s - 1.0);
+            }
+
+            if (p > 0.0) q = -q;
+            p = std::fabs(p);
+
+            if (2.0 * p < std::min(3.0 * middle * q - std::fabs(tolerance * q), std::fabs(e * q))) {
+                e = d;
+                d = p / q;
+            }
+            else {
+                d = e = middle;
+            }
+        }
+        else {
+            d = e = middle;
+        }
+
+        a = b;
+        fa = fb;
+        b += std::fabs(d) > tolerance ? d : (middle > 0.0 ? tolerance : -tolerance);
+        fb = f(b);
+    }
+
+    return (float)b;
+}
+
+/* Computes form t from its operands, with variables bound as in bindings. */
+float evaluateForm(const token &t, const float *operands, std::vector<float> bindings) {
+    switch ((formSlot)t.slot) {
+        case formSlot::sum:
+        case formSlot::prod:
+            return series(t, operands[0], operands[1], std::move(bindings), (formSlot)t.slot == formSlot::prod);
+
+        case formSlot::solve:
+            return solve(t, operands[0], operands[1], std::move(bindings));
+
+        default:
+            return integrate(t, operands[0], operands[1], std::move(bindings));
+    }
+}
+
+/* Half precision storage formats for batch columns; arithmetic stays float32. */
+enum class storage {
+    f16,
+    bf16
+};
+
+/* IEEE binary16 to float, exact including subnormals, infinities and NaN. */
+static inline float halfToFloat(uint16_t h) {
+    const uint32_t sign {(uint32_t)(h & 0x8000) << 16};
+    const uint32_t exponent {(uint32_t)(h >> 10) & 0x1f};
+    const uint32_t mantissa {(uint32_t)h & 0x3ff};
+    uint32_t bits {};
+
+    if (exponent == 0x1f) {
+        bits = sign | 0x7f800000 | mantissa << 13;
+    }
+    else if (exponent != 0) {
+        bits = sign | (exponent + 112) << 23 | mantissa << 13;
+    }
+    else {
+        /* Zero or subnormal: mantissa * 2^-24 is exact in float. */
+        const float value {(float)mantissa * 5.9604644775390625e-8f};
+        std::memcpy(&bits, &value, sizeof bits);
+        bits |= sign;
+    }
+
+    float f;
+    std::memcpy(&f, &bits, sizeof f);
+    return f;
+}
+
+/* Float to IEEE binary16, rounding to nearest even; overflow gives infinity. */
+static inline uint16_t floatToHalf(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof bits);
+
+    const uint16_t sign {(uint16_t)((bits >> 16) & 0x8000)};
+    const uint32_t magnitude {bits & 0x7fffffff};
+
+    if (magnitude > 0x7f800000) {
+        return sign | 0x7e00;
+    }
+    if (magnitude >= 0x477ff000) {
+        return sign | 0x7c00; // Rounds past 65504.
+    }
+    if (magnitude < 0x38800000) {
+        /* Subnormal half: let the float adder do the rounding at the 2^-24 quantum. */
+        float scaled;
+        std::memcpy(&scaled, &magnitude, sizeof scaled);
+        scaled += 0.5f;
+        uint32_t rounded;
+        std::memcpy(&rounded, &scaled, sizeof rounded);
+        return sign | (uint16_t)(rounded - 0x3f000000);
+    }
+
+    const uint32_t odd {(magnitude >> 13) & 1};
+    return sign | (uint16_t)((magnitude - 0x38000000 + 0xfff + odd) >> 13);
+}
+
+static inline float bfloatToFloat(uint16_t h) {
+    const uint32_t bits {(uint32_t)h << 16};
+    float f;
+    std::memcpy(&f, &bits, sizeof f);
+    return f;
+}
+
+/* Float to bfloat16, rounding to nearest even. */
+static inline uint16_t floatToBfloat(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof bits);
+
+    if ((bits & 0x7fffffff) > 0x7f800000) {
+        return (uint16_t)(bits >> 16) | 0x40;
+    }
+
+    return (uint16_t)((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+}
+
+/* Widens n values into a float tile, with F16C when the target has it. */
+void loadHalf(const uint16_t *in, float *out, size_t n, storage format) {
+    size_t k {0};
+
+    if (format == storage::bf16) {
+        for (; k < n; ++k) out[k] = bfloatToFloat(in[k]);
+        return;
+    }
+
+#if defined(__F16C__)
+    for (; k + 8 <= n; k += 8) {
+        _mm256_storeu_ps(out + k, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(in + k))));
+    }
+#endif
+
+    for (; k < n; ++k) out[k] = halfToFloat(in[k]);
+}
+
+void storeHalf(const float *in, uint16_t *out, size_t n, storage format) {
+    size_t k {0};
+
+    if (format == storage::bf16) {
+        for (; k < n; ++k) out[k] = floatToBfloat(in[k]);
+        return;
+    }
+
+#if defined(__F16C__)
+    for (; k + 8 <= n; k += 8) {
+        _mm_storeu_si128((__m128i *)(out + k), _mm256_cvtps_ph(_mm256_loadu_ps(in + k), _MM_FROUND_TO_NEAREST_INT));
+    }
+#endif
+
+    for (; k < n; ++k) out[k] = floatToHalf(in[k]);
+}
+
+/*
+ * Batch mode over half precision columns. Each tile is widened to float32
+ * just before it is computed and the result narrowed straight back, so only
+ * two bytes per value ever cross memory.
+ */
+void computeBatchHalf(const std::deque<token> &formatted, const std::vector<const uint16_t *> &columns, size_t count,
+                      uint16_t *results, storage format, bool approx = false) {
+    checkColumns(formatted, columns.size());
+
+    std::vector<float> stack(std::max<size_t>(stackDepth(formatted), 1) * tileSize);
+    std::vector<float> tiles(columns.size() * tileSize);
+    std::vector<const float *> vars(columns.size());
+
+    for (size_t c {0}; c < columns.size(); ++c) {
+        vars[c] = columns[c] != nullptr ? tiles.data() + c * tileSize : nullptr;
+    }
+
+    for (size_t base {0}; base < count; base += tileSize) {
+        const size_t rows {std::min(tileSize, count - base)};
+
+        for (size_t c {0}; c < columns.size(); ++c) {
+            if (columns[c] != nullptr) loadHalf(columns[c] + base, tiles.data() + c * tileSize, rows, format);
+        }
+
+        storeHalf(runTile(formatted, stack.data(), vars, rows, approx), results + base, rows, format);
+    }
+}
+
+/* Runs kernel(a, b, c, d) over a tile of complex lanes a + bi and c + di, writing a + bi back. */
+template <typename F>
+static void complexLanes(float *re, float *im, const float *re2, const float *im2, F kernel) {
+    for (size_t k {0}; k < tileSize; k += vlanes) {
+        vfloat a, b, c {}, d {};
+        std::memcpy(&a, re + k, sizeof a);
+        std::memcpy(&b, im + k, sizeof b);
+
+        if (re2 != nullptr) {
+            std::memcpy(&c, re2 + k, sizeof c);
+            std::memcpy(&d, im2 + k, sizeof d);
+        }
+
+        kernel(a, b, c, d);
+        std::memcpy(re + k, &a, sizeof a);
+        std::memcpy(im + k, &b, sizeof b);
+    }
+}
+
+static inline vfloat vcopysign(vfloat magnitude, vfloat sign) {
+    return (vfloat)((vint)vabs(magnitude) | ((vint)sign & (int32_t)0x80000000));
+}
+
+/* (a + bi)^(c + di) in polar form, as computeComplex's complexPow. */
+static inline void vcpow(vfloat &a, vfloat &b, vfloat c, vfloat d) {
+    const vint zero {(a == 0.0f) & (b == 0.0f)};
+    const vint zeroExponent {(c == 0.0f) & (d == 0.0f)};
+
+    const vfloat lnr {0.5f * vlog(a * a + b * b)};
+    const vfloat theta {vatan2(b, a)};
+    const vfloat m {vexp(c * lnr - d * theta)};
+    const vfloat angle {d * lnr + c * theta};
+
+    a = vselect(zero, vselect(zeroExponent, vsplat(1.0f), vsplat(0.0f)), m * vcos(angle));
+    b = vselect(zero, vsplat(0.0f), m * vsin(angle));
+}
+
+/*
+ * Complex batch mode. Like computeBatch, but every stack entry is a pair of
+ * split real and imaginary tiles instead of interleaved pairs, so each
+ * operation is a plain vector loop over each part. Ordering comparisons of
+ * lanes with a non-zero imaginary part give NaN instead of an error.
+ */
+void computeComplexBatch(const std::deque<token> &formatted, const std::vector<const float *> &reColumns,
+                         const std::vector<const float *> &imColumns, size_t count, float *reOut, float *imOut) {
+    for (const token &t: formatted) {
+        if (t.type == tokenType::mod) {
+            notComplex("%");
+        }
+
+        if (t.type == tokenType::fun && (std::string {builtins[t.slot].name} == "min" || std::string {builtins[t.slot].name} == "max")) {
+            notComplex(builtins[t.slot].name);
+        }
+    }
+
+    const size_t depth {std::max<size_t>(stackDepth(formatted), 1) * tileSize};
+    std::vector<float> reStack(depth), imStack(depth);
+
+    for (size_t base {0}; base < count; base += tileSize) {
+        const size_t rows {std::min(tileSize, count - base)};
+        size_t top {0};
+
+        for (const token &t: formatted) {
+            switch (t.type) {
+                case tokenType::i32:
+                case tokenType::f32:
+                case tokenType::img: {
+                    const float value {t.type == tokenType::i32 ? (float)t.intData : t.fltData};
+                    std::fill_n(reStack.data() + top, tileSize, t.type == tokenType::img ? 0.0f : value);
+                    std::fill_n(imStack.data() + top, tileSize, t.type == tokenType::img ? value : 0.0f);
+                    top += tileSize;
+                    break;
+                }
+
+                case tokenType::var:
+                    if (t.slot >= reColumns.size()) {
+                        fail("Unbound variable: ", t.strData);
+                    }
+
+                    std::copy_n(reColumns[t.slot] + base, rows, reStack.data() + top);
+                    std::copy_n(imColumns[t.slot] + base, rows, imStack.data() + top);
+                    top += tileSize;
+                    break;
+
+                case tokenType::fun: {
+                    float *re {reStack.data() + top - tileSize};
+                    float *im {imStack.data() + top - tileSize};
+
+                    switch ((builtinSlot)t.slot) {
+                        case builtinSlot::sqrt:
+                            complexLanes(re, im, nullptr, nullptr, [](vfloat &a, vfloat &b, vfloat, vfloat) {
+                                const vfloat r {vsqrt(a * a + b * b)};
+                                const vfloat real {vsqrt((r + a) * 0.5f)};
+                                b = vcopysign(vsqrt((r - a) * 0.5f), b);
+                                a = real;
+                            });
+                            break;
+
+                        case builtinSlot::abs:
+                            complexLanes(re, im, nullptr, nullptr, [](vfloat &a, vfloat &b, vfloat, vfloat) {
+                                a = vsqrt(a * a + b * b);
+                                b = vsplat(0.0f);
+                            });
+                            break;
+
+                        case builtinSlot::exp:
+                            complexLanes(re, im, nullptr, nullptr, [](vfloat &a, vfloat &b, vfloat, vfloat) {
+                                const vfloat m {vexp(a)};
+                                a = m * vcos(b);
+                                b = m * vsin(b);
+                            });
+                            break;
+
+                        case builtinSlot::log:
+                            complexLanes(re, im, nullptr, nullptr, [](vfloat &a, vfloat &b, vfloat, vfloat) {
+                                const vfloat real {0.5f * vlog(a * a + b * b)};
+                                b = vatan2(b, a);
+                                a = real;
+                            });
+                            break;
+
+                        case builtinSlot::sin:
+                        case builtinSlot::cos: {
+                            const bool sine {(builtinSlot)t.slot == builtinSlot::sin};
+                            complexLanes(re, im, nullptr, nullptr, [sine](vfloat &a, vfloat &b, vfloat, vfloat) {
+                                const vfloat up {vexp(b)}, down {vexp(-b)};
+                                const vfloat cosh {(up + down) * 0.5f}, sinh {(up - down) * 0.5f};
+                                const vfloat s {vsin(a)}, c {vcos(a)};
+                                a = sine ? s * cosh : c * cosh;
+                                b = sine ? c * sinh : -s * sinh;
+                            });
+                            break;
+                        }
+
+                        case builtinSlot::floor:
+                            batchUnary<vfloor>(re, nullptr, tileSize);
+                            batchUnary<vfloor>(im, nullptr, tileSize);
+                            break;
+
+                        default: break;
+                    }
+                    break;
+                }
+
+                case tokenType::col: {
+                    top -= 2 * tileSize;
+                    float *cond {reStack.data() + top - tileSize};
+                    float *condIm {imStack.data() + top - tileSize};
+
+                    for (size_t k {0}; k < tileSize; ++k) {
+                        cond[k] = (cond[k] != 0.0f) | (condIm[k] != 0.0f);
+                    }
+
+                    std::copy_n(cond, tileSize, condIm);
+                    batchSelect(cond, reStack.data() + top, reStack.data() + top + tileSize, tileSize);
+                    batchSelect(condIm, imStack.data() + top, imStack.data() + top + tileSize, tileSize);
+                    break;
+                }
+
+                case tokenType::add:
+                case tokenType::sub:
+                case tokenType::mul:
+                case tokenType::div:
+                case tokenType::exp:
+                case tokenType::lt:
+                case tokenType::gt:
+                case tokenType::le:
+                case tokenType::ge:
+                case tokenType::eq:
+                case tokenType::ne:
+                case tokenType::land:
+                case tokenType::lor: {
+                    if (t.unary) {
+                        float *re {reStack.data() + top - tileSize};
+                        float *im {imStack.data() + top - tileSize};
+                        for (size_t k {0}; k < tileSize; ++k) re[k] = 0.0f - re[k];
+                        for (size_t k {0}; k < tileSize; ++k) im[k] = 0.0f - im[k];
+                        break;
+                    }
+
+                    top -= tileSize;
+                    const float *c {reStack.data() + top};
+                    const float *d {imStack.data() + top};
+                    float *a {reStack.data() + top - tileSize};
+                    float *b {imStack.data() + top - tileSize};
+
+                    switch (t.type) {
+                        case tokenType::add:
+                            for (size_t k {0}; k < tileSize; ++k) a[k] += c[k];
+                            for (size_t k {0}; k < tileSize; ++k) b[k] += d[k];
+                            break;
+
+                        case tokenType::sub:
+                            for (size_t k {0}; k < tileSize; ++k) a[k] -= c[k];
+                            for (size_t k {0}; k < tileSize; ++k) b[k] -= d[k];
+                            break;
+
+                        case tokenType::mul:
+                            for (size_t k {0}; k < tileSize; ++k) {
+                                const float real {a[k] * c[k] - b[k] * d[k]};
+                                b[k] = a[k] * d[k] + b[k] * c[k];
+                                a[k] = real;
+                            }
+                            break;
+
+                        case tokenType::div:
+                            for (size_t k {0}; k < tileSize; ++k) {
+                                const float denominator {c[k] * c[k] + d[k] * d[k]};
+                                const float real {(a[k] * c[k] + b[k] * d[k]) / denominator};
+                                b[k] = (b[k] * c[k] - a[k] * d[k]) / denominator;
+                                a[k] = real;
+                            }
+                            break;
+
+                        case tokenType::exp:
+                            complexLanes(a, b, c, d, vcpow);
+                            break;
+
+                        case tokenType::eq:
+                        case tokenType::ne:
+                            for (size_t k {0}; k < tileSize; ++k) {
+                                a[k] = ((a[k] == c[k]) & (b[k] == d[k])) == (t.type == tokenType::eq);
+                            }
+                            std::fill_n(b, tileSize, 0.0f);
+                            break;
+
+                        case tokenType::land:
+                        case tokenType::lor:
+                            for (size_t k {0}; k < tileSize; ++k) {
+                                const bool lhs {a[k] != 0.0f || b[k] != 0.0f};
+                                const bool rhs {c[k] != 0.0f || d[k] != 0.0f};
+                                a[k] = t.type == tokenType::land ? lhs & rhs : lhs | rhs;
+                            }
+                            std::fill_n(b, tileSize, 0.0f);
+                            break;
+
+                        default:
+                            for (size_t k {0}; k < tileSize; ++k) {
+                                const float ordered {(float)(t.type == tokenType::lt ? a[k] < c[k]
+                                                           : t.type == tokenType::gt ? a[k] > c[k]
+                                                           : t.type == tokenType::le ? a[k] <= c[k]
+                                                           : a[k] >= c[k])};
+                                a[k] = (b[k] == 0.0f) & (d[k] == 0.0f) ? ordered : NAN;
+                            }
+                            std::fill_n(b, tileSize, 0.0f);
+                            break;
+                    }
+                    break;
+                }
+
+                default: break;
+            }
+        }
+
+        std::copy_n(reStack.data() + top - tileSize, rows, reOut + base);
+        std::copy_n(imStack.data() + top - tileSize, rows, imOut + base);
+    }
+}
+
+/*
+ * Array-valued expressions such as [1, 2, 3] * 2 + [4, 5, 6]. Every array
+ * literal becomes a column and every scalar broadcasts, then the program runs
+ * through computeBatch, so a chain of elementwise operations is fused into a
+ * single pass over tiles with no array-sized temporaries.
+ */
+std::vector<float> computeArray(const std::deque<token> &formatted, const std::vector<float> &bindings, bool approx = false) {
+    std::deque<token> program {};
+    std::vector<std::vector<float>> arrays {};
+
+    for (const token &t: formatted) {
+        /* Variables are constant for the whole array, so they become literals and the only columns are arrays. */
+        if (t.type == tokenType::var) {
+            if (t.slot >= bindings.size()) {
+                fail("Unbound variable: ", t.strData);
+            }
+
+            token literal {};
+            literal.type = tokenType::f32;
+            literal.fltData = bindings[t.slot];
+            program.push_back(literal);
+            continue;
+        }
+
+        if (t.type != tokenType::lbr) {
+            program.push_back(t);
+            continue;
+        }
+
+        std::vector<float> elements(t.argc);
+        for (size_t e {t.argc}; e > 0; --e) {
+            const size_t start {operandStart(program, program.size())};
+            const std::deque<token> element(program.begin() + (long)start, program.end());
+
+            if (std::any_of(element.begin(), element.end(), [](const token &p) { return p.type == tokenType::var; })) {
+                fail("Array elements must be scalars");
+            }
+
+            elements[e - 1] = compute(element);
+            program.erase(program.begin() + (long)start, program.end());
+        }
+
+        if (!arrays.empty() && elements.size() != arrays[0].size()) {
+            fail("Array lengths differ: ", arrays[0].size(), " and ", elements.size());
+        }
+
+        token column {};
+        column.type = tokenType::var;
+        column.strData = "[]";
+        column.slot = arrays.size();
+        arrays.push_back(std::move(elements));
+        program.push_back(column);
+    }
+
+    std::vector<const float *> columns {};
+    for (const std::vector<float> &array: arrays) {
+        columns.push_back(array.data());
+    }
+
+    return computeBatch(program, columns, arrays.empty() ? 1 : arrays[0].size(), approx);
+}
+
+/* Compiles and runs one expression in the environment's mode, formatted for printing. */
+std::string evaluate(lexana &lexer, const std::string &exprStr) {
+    const environment &env {lexer.getEnvironment()};
+    const std::shared_ptr<const cachedProgram> program {compileCached(lexer, exprStr)};
+
+    if (program == nullptr) {
+        fail("Empty expression");
+    }
+
+    const std::deque<token> &compiled {program->compiled};
+
+    for (const size_t slot: program->reads) {
+        if (!env.hasValue(slot)) {
+            fail("Unbound variable: ", env.variables[slot]);
+        }
+    }
+
+    if (containsArray(compiled)) {
+        if (env.mode != evalMode::real) {
+            fail("Arrays are only supported in the float mode");
+        }
+
+        std::ostringstream out {};
+        out << '[';
+        for (const float value: computeArray(compiled, env.values, env.approx)) {
+            out << (out.tellp() > 1 ? ", " : "") << value;
+        }
+        out << ']';
+        return out.str();
+    }
+
+    const std::deque<token> &formatted {program->scalar()};
+
+    if (env.mode == evalMode::decimal) {
+        return decimalToString(computeDecimal(formatted, env.scale, env.units), env.scale);
+    }
+
+    if (env.mode == evalMode::bignum) {
+        return bigToString(computeBig(formatted, env.integers));
+    }
+
+    if (env.mode == evalMode::complex) {
+        return complexToString(computeComplex(formatted, env.complexes));
+    }
+
+    std::ostringstream out {};
+    out << compute(formatted, env.values);
+    return out.str();
+}
+
+#if defined(SHUNTING_LIBRARY)
+
+/* The C interface of shunting.h. Every evalError, and anything else thrown, becomes a return value and a message. */
+
+struct shunting_context {
+    environment env {};
+    lexana lexer {env};
+    std::string error {};
+    cancellation token {};
+    std::chrono::milliseconds timeout {0};
+    std::vector<float> bindings {}; // env.values with the positional slots of the program being evaluated filled in.
+    bool stale {true};              // bindings no longer match env.values.
+    bool operation {false};         // Between shunting_begin_operation and shunting_end_operation, calls keep token as it is.
+};
+
+struct shunting_program {
+    std::deque<token> batch {};          // As compiled, for computeBatch.
+    std::deque<token> scalar {};         // With branches lowered and superinstructions fused, for compute.
+    std::vector<size_t> slots {};        // Slot of each variable bound by position.
+    std::vector<std::string> names {};
+};
+
+/* Uncancelled, with a deadline from now if the context has a timeout. */
+void restartToken(shunting_context *context) {
+    context->token.cancelled = false;
+    context->token.deadline = context->timeout.count() > 0 ? std::chrono::steady_clock::now() + context->timeout
+                                                           : std::chrono::steady_clock::time_point::max();
+}
+
+/* Each call restarts the token, unless it is one step of an operation, which restarted it once. */
+template <typename F>
+int guarded(shunting_context *context, F fn) {
+    if (!context->operation) {
+        restartToken(context);
+    }
+
+    const cancellationScope scope {&context->token};
+
+    try {
+        context->error.clear();
+        fn();
+        return 1;
+    }
+    catch (const std::exception &e) {
+        context->error = e.what();
+        return 0;
+    }
+}
+
+extern "C" {
+
+shunting_context *shunting_create(void) {
+    return new (std::nothrow) shunting_context {};
+}
+
+void shunting_destroy(shunting_context *context) {
+    delete context;
+}
+
+const char *shunting_error(const shunting_context *context) {
+    return context->error.c_str();
+}
+
+void shunting_set_timeout(shunting_context *context, unsigned long milliseconds) {
+    context->timeout = std::chrono::milliseconds {milliseconds};
+}
+
+void shunting_cancel(shunting_context *context) {
+    context->token.cancel();
+}
+
+void shunting_begin_operation(shunting_context *context) {
+    restartToken(context);
+    context->operation = true;
+}
+
+void shunting_end_operation(shunting_context *context) {
+    context->operation = false;
+}
+
+int shunting_define(shunting_context *context, const char *definition) {
+    context->stale = true;
+
+    return guarded(context, [&] {
+        if (context->env.mode != evalMode::real || !define(context->lexer, definition)) {
+            fail("Not a definition: ", definition);
+        }
+    });
+}
+
+shunting_program *shunting_compile(shunting_context *context, const char *expression) {
+    std::unique_ptr<shunting_program> program {};
+
+    const bool compiled {guarded(context, [&] {
+        program = std::make_unique<shunting_program>();
+        program->batch = compile(context->lexer, expression);
+
+        if (program->batch.empty()) {
+            fail("Empty expression");
+        }
+
+        if (containsArray(program->batch)) {
+            fail("The C interface evaluates scalars");
+        }
+
+        program->scalar = fuse(lowerBranches(program->batch));
+
+        std::vector<bool> read {};
+        markReads(program->batch, read);
+
+        for (size_t slot {0}; slot < read.size(); ++slot) {
+            if (read[slot] && !context->env.hasValue(slot)) {
+                program->slots.push_back(slot);
+                program->names.push_back(context->env.variables[slot]);
+            }
+        }
+    }) != 0};
+
+    return compiled ? program.release() : nullptr;
+}
+
+void shunting_free(shunting_program *program) {
+    delete program;
+}
+
+size_t shunting_variable_count(const shunting_program *program) {
+    return program->slots.size();
+}
+
+const char *shunting_variable_name(const shunting_program *program, size_t index) {
+    return index < program->names.size() ? program->names[index].c_str() : nullptr;
+}
+
+/*
+ * Binds in the context's copy of the variables, refreshed only after a
+ * definition, so a call allocates nothing. The positional slots are put back
+ * afterwards: another program may read the same variable as defined.
+ */
+int shunting_evaluate(shunting_context *context, const shunting_program *program, const float *bindings, float *result) {
+    const environment &env {context->env};
+    std::vector<float> &values {context->bindings};
+
+    if (context->stale || values.size() < env.variables.size()) {
+        values = env.values;
+        values.resize(env.variables.size(), NAN);
+        context->stale = false;
+    }
+
+    for (size_t i {0}; i < program->slots.size(); ++i) {
+        values[program->slots[i]] = bindings[i];
+    }
+
+    const int ok {guarded(context, [&] { *result = compute(program->scalar, values); })};
+
+    for (const size_t slot: program->slots) {
+        values[slot] = slot < env.values.size() ? env.values[slot] : NAN;
+    }
+
+    return ok;
+}
+
+int shunting_evaluate_batch(shunting_context *context, const shunting_program *program, const float *const *columns,
+                            size_t rows, float *results) {
+    return guarded(context, [&] {
+        const environment &env {context->env};
+
+        /* Variables with a value become constant columns. */
+        std::vector<std::vector<float>> constants(env.variables.size());
+        std::vector<const float *> bound(env.variables.size(), nullptr);
+        std::vector<bool> read {};
+        markReads(program->batch, read);
+
+        for (size_t i {0}; i < program->slots.size(); ++i) {
+            bound[program->slots[i]] = columns[i];
+        }
+
+        for (size_t slot {0}; slot < read.size(); ++slot) {
+            if (read[slot] && bound[slot] == nullptr) {
+                constants[slot].assign(rows, slot < env.values.size() ? env.values[slot] : NAN);
+                bound[slot] = constants[slot].data();
+            }
+        }
+
+        const std::vector<float> computed {computeBatch(program->batch, bound, rows)};
+        std::copy(computed.begin(), computed.end(), results);
+    });
+}
+
+}
+
+#else
+
+/*
+ * Reads one row of whitespace separated variable values per line from stdin
+ * and prints one result per row. In the complex mode every variable takes a
+ * real and an imaginary value.
+ */
+int runBatch(environment &env, const std::string &exprStr) {
+    lexana lexer {env};
+
+    const std::deque<token> formatted {compile(lexer, exprStr)};
+    if (formatted.empty()) {
+        return 1;
+    }
+
+    if ((env.mode != evalMode::real && env.mode != evalMode::complex) || containsArray(formatted)) {
+        std::cerr << "Batch mode computes scalars in float or complex\n";
+        return 1;
+    }
+
+    const bool complex {env.mode == evalMode::complex};
+    std::vector<std::vector<float>> values(lexer.getVariables().size() * (complex ? 2 : 1));
+    std::string line {};
+    size_t count {0};
+
+    /* Variables that only a form binds take no input. */
+    std::vector<bool> read {};
+    markReads(formatted, read);
+    read.resize(lexer.getVariables().size());
+    const size_t inputs {(size_t)std::count(read.begin(), read.end(), true) * (complex ? 2 : 1)};
+
+    while (std::getline(std::cin, line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+
+        std::istringstream row {line};
+        for (size_t c {0}; c < values.size(); ++c) {
+            if (!read[complex ? c / 2 : c]) {
+                continue;
+            }
+
+            float value {};
+            if (!(row >> value)) {
+                std::cerr << "Row " << count + 1 << " needs " << inputs << " values\n";
+                return 1;
+            }
+
+            values[c].push_back(value);
+        }
+
+        ++count;
+    }
+
+    std::vector<const float *> columns {}, imColumns {};
+    for (size_t c {0}; c < values.size(); ++c) {
+        (complex && c % 2 == 1 ? imColumns : columns).push_back(read[complex ? c / 2 : c] ? values[c].data() : nullptr);
+    }
+
+    if (complex) {
+        std::vector<float> re(count), im(count);
+        computeComplexBatch(formatted, columns, imColumns, count, re.data(), im.data());
+
+        for (size_t r {0}; r < count; ++r) {
+            std::cout << complexToString({re[r], im[r]}) << '\n';
+        }
+
+        return 0;
+    }
+
+    for (const float result: computeBatch(formatted, columns, count, env.approx)) {
+        std::cout << result << '\n';
+    }
+
+    return 0;
+}
+
+/* Partitions of the deduplication pass of runBatchFile; each one is deduplicated by one thread. */
+constexpr size_t dedupePartitions {64};
+
+/*
+ * Evaluates every line of a file as its own expression and prints one result
+ * per line, in order, as pipe mode would. Batch files repeat the same
+ * formulas many times, so the lines are first hashed and deduplicated in
+ * parallel, each distinct line is evaluated once, and its result is copied
+ * back to the lines that repeat it. Only expressions between the same two
+ * definitions count as repeats; definitions themselves, and expressions that
+ * draw random variables, run every time. Results before a failing line are
+ * printed before the error ends the run.
+ */
+int runBatchFile(environment &env, const std::string &path) {
+    std::ifstream file {path};
+    if (!file) {
+        std::cerr << "Cannot open " << path << '\n';
+        return 1;
+    }
+
+    std::vector<std::string> lines {};
+    for (std::string line {}; std::getline(file, line);) {
+        lines.push_back(std::move(line));
+    }
+
+    const size_t count {lines.size()};
+
+    /* Definitions split the file into runs; a line can only repeat one of its own run. */
+    std::vector<size_t> runs(count);
+    for (size_t i {0}, run {0}; i < count; ++i) {
+        const bool definition {findAssignment(lines[i]) != std::string::npos};
+        run += definition;
+        runs[i] = definition ? SIZE_MAX : run;
+    }
+
+    std::vector<uint64_t> hashes(count);
+    parallelFor((count + tileSize - 1) / tileSize, [&](size_t tile) {
+        for (size_t i {tile * tileSize}; i < std::min(count, (tile + 1) * tileSize); ++i) {
+            hashes[i] = mix64(fnv1a(lines[i]));
+        }
+    });
+
+    /* Equal lines share a partition, so each partition finds its first occurrences alone. */
+    std::vector<std::vector<size_t>> partitions(dedupePartitions);
+    for (size_t i {0}; i < count; ++i) {
+        partitions[hashes[i] % dedupePartitions].push_back(i);
+    }
+
+    std::vector<size_t> first(count);
+    parallelFor(dedupePartitions, [&](size_t p) {
+        std::unordered_multimap<uint64_t, size_t> seen {};
+
+        for (const size_t i: partitions[p]) {
+            first[i] = i;
+            if (runs[i] == SIZE_MAX) {
+                continue;
+            }
+
+            const auto [begin, end] {seen.equal_range(hashes[i])};
+            for (auto it {begin}; it != end; ++it) {
+                if (runs[it->second] == runs[i] && lines[it->second] == lines[i]) {
+                    first[i] = it->second;
+                    break;
+                }
+            }
+
+            if (first[i] == i) {
+                seen.emplace(hashes[i], i);
+            }
+        }
+    });
+
+    lexana lexer {env};
+    std::vector<std::string> results(count);
+    std::vector<bool> random(count);
+    size_t i {0};
+
+    const auto print {[&] {
+        for (size_t k {0}; k < i; ++k) {
+            std::cout << results[k] << '\n';
+        }
+        std::cout.flush();
+    }};
+
+    try {
+        for (; i < count; ++i) {
+            if (first[i] != i && !random[first[i]]) {
+                results[i] = results[first[i]];
+            }
+            else if (lines[i].find_first_not_of(" \t\r") == std::string::npos) {
+                continue;
+            }
+            else if (define(lexer, lines[i])) {
+                results[i] = "Defined.";
+            }
+            else {
+                results[i] = evaluate(lexer, lines[i]);
+                random[i] = drawsRandom(compileCached(lexer, lines[i])->compiled);
+            }
+        }
+    }
+    catch (const evalError &) {
+        print();
+        throw;
+    }
+
+    print();
+    return 0;
+}
+
+/*
+ * --format f16|bf16: stdin holds the variable columns back to back as raw
+ * 16 bit values, one column per variable in order of first appearance, and
+ * the results are written to stdout in the same format.
+ */
+int runHalfBatch(environment &env, const std::string &exprStr, storage format) {
+    lexana lexer {env};
+
+    const std::deque<token> formatted {compile(lexer, exprStr)};
+    if (formatted.empty()) {
+        return 1;
+    }
+
+    if (env.mode != evalMode::real || containsArray(formatted)) {
+        std::cerr << "Half precision batches compute scalars in float\n";
+        return 1;
+    }
+
+    std::vector<bool> read {};
+    markReads(formatted, read);
+    read.resize(lexer.getVariables().size());
+
+    const size_t variables {(size_t)std::count(read.begin(), read.end(), true)};
+    if (variables == 0) {
+        std::cerr << "Half precision batches need at least one variable\n";
+        return 1;
+    }
+
+    std::vector<uint16_t> data {};
+    uint16_t buffer[4096];
+    while (std::cin.read((char *)buffer, sizeof buffer) || std::cin.gcount() > 0) {
+        if (std::cin.gcount() % 2 != 0) {
+            std::cerr << "Input is not a whole number of 16 bit values\n";
+            return 1;
+        }
+
+        data.insert(data.end(), buffer, buffer + std::cin.gcount() / 2);
+    }
+
+    if (data.size() % variables != 0) {
+        std::cerr << "Input does not split into " << variables << " equal columns\n";
+        return 1;
+    }
+
+    const size_t count {data.size() / variables};
+    std::vector<const uint16_t *> columns(read.size());
+    for (size_t c {0}, input {0}; c < read.size(); ++c) {
+        columns[c] = read[c] ? data.data() + input++ * count : nullptr;
+    }
+
+    std::vector<uint16_t> results(count);
+    computeBatchHalf(formatted, columns, count, results.data(), format, env.approx);
+    std::cout.write((const char *)results.data(), (std::streamsize)(count * sizeof(uint16_t)));
+
+    return 0;
+}
+
+/* Streaming mean and variance (Welford), merged across chunks with the pairwise formula of Chan, Golub and LeVeque. */
+class moments {
+public:
+    void add(double x) {
+        ++count;
+        const double delta {x - mean};
+        mean += delta / (double)count;
+        m2 += delta * (x - mean);
+    }
+
+    void merge(const moments &other) {
+        if (other.count == 0) {
+            return;
+        }
+
+        const double n {(double)(count + other.count)};
+        const double delta {other.mean - mean};
+        mean += delta * (double)other.count / n;
+        m2 += other.m2 + delta * delta * (double)count * (double)other.count / n;
+        count += other.count;
+    }
+
+    [[nodiscard]] double variance() const {
+        return count > 1 ? m2 / (double)(count - 1) : 0.0;
+    }
+
+    size_t count {};
+    double mean {};
+    double m2 {}; // Sum of squared deviations from the mean.
+};
+
+/* Streaming estimate of one quantile in constant space: the P² algorithm of Jain and Chlamtac (1985). */
+class p2Quantile {
+public:
+    explicit p2Quantile(double _p) : p {_p} {}
+
+    void add(double x) {
+        if (count < 5) {
+            heights[count++] = x;
+
+            if (count == 5) {
+                std::sort(heights, heights + 5);
+                for (size_t i {0}; i < 5; ++i) positions[i] = (double)i + 1.0;
+                desired[0] = 1.0;
+                desired[1] = 1.0 + 2.0 * p;
+                desired[2] = 1.0 + 4.0 * p;
+                desired[3] = 3.0 + 2.0 * p;
+                desired[4] = 5.0;
+            }
+            return;
+        }
+
+        /* Cell k with heights[k] <= x < heights[k + 1], stretching the extremes if needed. */
+        size_t k {0};
+        if (x < heights[0]) {
+            heights[0] = x;
+        }
+        else if (x >= heights[4]) {
+            heights[4] = x;
+            k = 3;
+        }
+        else {
+            while (x >= heights[k + 1]) ++k;
+        }
+
+        for (size_t i {k + 1}; i < 5; ++i) positions[i] += 1.0;
+        const double increments[5] {0.0, p / 2.0, p, (1.0 + p) / 2.0, 1.0};
+        for (size_t i {0}; i < 5; ++i) desired[i] += increments[i];
+        ++count;
+
+        /* Move the middle markers towards their desired positions, parabolically if that keeps them ordered. */
+        for (size_t i {1}; i < 4; ++i) {
+            const double d {desired[i] - positions[i]};
+
+            if ((d >= 1.0 && positions[i + 1] - positions[i] > 1.0) || (d <= -1.0 && positions[i - 1] - positions[i] < -1.0)) {
+                const double s {d >= 0.0 ? 1.0 : -1.0};
+                const double n0 {positions[i - 1]}, n1 {positions[i]}, n2 {positions[i + 1]};
+                double h {heights[i] + s / (n2 - n0) * ((n1 - n0 + s) * (heights[i + 1] - heights[i]) / (n2 - n1)
+                                                        + (n2 - n1 - s) * (heights[i] - heights[i - 1]) / (n1 - n0))};
+
+                if (!(heights[i - 1] < h && h < heights[i + 1])) {
+                    const size_t j {s > 0.0 ? i + 1 : i - 1};
+                    h = heights[i] + s * (heights[j] - heights[i]) / (positions[j] - positions[i]);
+                }
+
+                heights[i] = h;
+                positions[i] += s;
+            }
+        }
+    }
+
+    /* With fewer than five observations this is the nearest order statistic. */
+    [[nodiscard]] double value() const {
+        if (count >= 5) {
+            return heights[2];
+        }
+        if (count == 0) {
+            return NAN;
+        }
+
+        std::vector<double> sorted(heights, heights + count);
+        std::sort(sorted.begin(), sorted.end());
+        return sorted[(size_t)std::lround(p * (double)(count - 1))];
+    }
+
+    double p;
+    size_t count {};
+
+private:
+    double heights[5] {};
+    double positions[5] {};
+    double desired[5] {};
+};
+
+/* Quantiles reported by --montecarlo. */
+static const double monteCarloQuantiles[] {0.01, 0.05, 0.5, 0.95, 0.99};
+
+/* Streaming statistics of the results of one chunk of samples, or all of them once merged. */
+class sampleSummary {
+public:
+    sampleSummary() {
+        for (const double p: monteCarloQuantiles) {
+            quantiles.emplace_back(p);
+        }
+    }
+
+    void add(float x) {
+        if (std::isnan(x)) {
+            ++invalid;
+            return;
+        }
+
+        stats.add(x);
+        for (p2Quantile &q: quantiles) q.add(x);
+    }
+
+    /* Moments merge exactly; quantile estimates are averaged weighted by their sample counts. */
+    void merge(const sampleSummary &other) {
+        for (size_t i {0}; i < quantiles.size(); ++i) {
+            const double n {(double)(stats.count + other.stats.count)};
+            if (other.stats.count > 0) {
+                estimates[i] = (estimates[i] * (double)stats.count + other.quantiles[i].value() * (double)other.stats.count) / n;
+            }
+        }
+
+        stats.merge(other.stats);
+        invalid += other.invalid;
+    }
+
+    moments stats {};
+    std::vector<p2Quantile> quantiles {};
+    double estimates[std::size(monteCarloQuantiles)] {}; // Merged quantiles.
+    size_t invalid {}; // NaN results, left out of the statistics.
+};
+
+/*
+ * Gives every random variable in the program a draw of its own: its samples
+ * are column firstSlot + d, passed as an extra argument. normals[d] tells
+ * whether draw d is standard normal rather than uniform.
+ */
+std::deque<token> prepareDraws(const std::deque<token> &formatted, size_t firstSlot, std::vector<bool> &normals) {
+    std::deque<token> out {};
+
+    for (token t: formatted) {
+        if (t.type == tokenType::fun && builtins[t.slot].random) {
+            token samples {};
+            samples.type = tokenType::var;
+            samples.strData = t.strData;
+            samples.slot = firstSlot + normals.size();
+            normals.push_back(std::string {builtins[t.slot].name} == "normal");
+
+            out.push_back(samples);
+            ++t.argc;
+        }
+
+        out.push_back(t);
+    }
+
+    return out;
+}
+
+/* Samples per unit of work; fixed so that the split, and so the merged estimates, do not depend on the thread count. */
+constexpr size_t monteCarloChunk {16 * tileSize};
+
+/*
+ * Monte Carlo mode: evaluates the program for count samples of its random
+ * variables and summarizes the results. Sample i of every draw depends only
+ * on seed, the draw and i, and chunks are merged in order, so the result is
+ * the same for a given seed on any number of threads.
+ */
+sampleSummary computeMonteCarlo(const std::deque<token> &formatted, size_t count, uint64_t seed, bool approx = false) {
+    for (const token &t: formatted) {
+        if (t.type == tokenType::var) {
+            fail("Monte Carlo expressions take random variables, not variables: ", t.strData);
+        }
+    }
+
+    std::vector<bool> normals {};
+    const std::deque<token> program {prepareDraws(formatted, 0, normals)};
+    checkColumns(program, normals.size());
+
+    const size_t depth {std::max<size_t>(stackDepth(program), 1)};
+    std::vector<sampleSummary> chunks((count + monteCarloChunk - 1) / monteCarloChunk);
+
+    parallelFor(chunks.size(), [&](size_t chunk) {
+        std::vector<float> stack(depth * tileSize);
+        std::vector<float> samples(normals.size() * tileSize);
+        std::vector<const float *> vars(normals.size());
+
+        const size_t end {std::min(count, (chunk + 1) * monteCarloChunk)};
+        for (size_t base {chunk * monteCarloChunk}; base < end; base += tileSize) {
+            const size_t rows {std::min(tileSize, end - base)};
+
+            for (size_t d {0}; d < normals.size(); ++d) {
+                fillSamples(samples.data() + d * tileSize, seed, d, base, rows, normals[d]);
+                vars[d] = samples.data() + d * tileSize;
+            }
+
+            const float *results {runTile(program, stack.data(), vars, rows, approx)};
+            for (size_t r {0}; r < rows; ++r) {
+                chunks[chunk].add(results[r]);
+            }
+        }
+    });
+
+    sampleSummary total {};
+    for (const sampleSummary &chunk: chunks) {
+        total.merge(chunk);
+    }
+
+    return total;
+}
+
+/* --montecarlo <samples> <expression> [--seed <n>]: prints the statistics of the expression's distribution. */
+int runMonteCarlo(environment &env, const std::string &exprStr, size_t count, uint64_t seed) {
+    lexana lexer {env};
+
+    const std::deque<token> formatted {compile(lexer, exprStr)};
+    if (formatted.empty()) {
+        return 1;
+    }
+
+    if (env.mode != evalMode::real || containsArray(formatted)) {
+        std::cerr << "Monte Carlo mode computes scalars in float\n";
+        return 1;
+    }
+
+    const sampleSummary summary {computeMonteCarlo(formatted, count, seed, env.approx)};
+    const moments &stats {summary.stats};
+
+    std::cout << "samples  " << stats.count << '\n'
+              << "mean     " << stats.mean << '\n'
+              << "stddev   " << std::sqrt(stats.variance()) << '\n'
+              << "stderr   " << std::sqrt(stats.variance() / (double)std::max<size_t>(stats.count, 1)) << '\n';
+
+    for (size_t i {0}; i < std::size(monteCarloQuantiles); ++i) {
+        std::cout << 'p' << std::left << std::setw(8) << monteCarloQuantiles[i] * 100.0 << std::right << summary.estimates[i] << '\n';
+    }
+
+    if (summary.invalid > 0) {
+        std::cout << "nan      " << summary.invalid << '\n';
+    }
+
+    return 0;
+}
+
+/*
+ * --record <file>: a log of the lines the REPL or server was sent, for
+ * --replay. After a header with the mode, each line is stored as the
+ * nanoseconds since the previous one and its length, both as LEB128
+ * varints, then its text. Lines come from any connection thread, so records
+ * are appended under a lock, which also keeps their times in order.
+ */
+class recorder {
+public:
+    static constexpr uint64_t formatMagic {0x5359524c'00000001ull}; // "SYRL", then the format version.
+
+    recorder(const std::string &path, const environment &env) : file {path, std::ios::binary | std::ios::trunc} {
+        if (!file) {
+            fail("Cannot write ", path);
+        }
+
+        const uint64_t header[] {formatMagic, (uint64_t)env.mode << 32 | (uint32_t)env.scale};
+        file.write((const char *)header, sizeof header);
+        file.flush();
+    }
+
+    /* Flushed at once, so a server that is killed keeps what it answered. */
+    void record(const std::string &line) {
+        const std::lock_guard lock {mutex};
+        const auto now {std::chrono::steady_clock::now()};
+
+        std::string out {};
+        appendVarint(out, (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count());
+        appendVarint(out, line.size());
+        out += line;
+
+        file.write(out.data(), (std::streamsize)out.size());
+        file.flush();
+        last = now;
+    }
+
+    static void appendVarint(std::string &out, uint64_t value) {
+        for (; value >= 0x80; value >>= 7) {
+            out += (char)(value | 0x80);
+        }
+        out += (char)value;
+    }
+
+private:
+    std::mutex mutex {};
+    std::ofstream file;
+    std::chrono::steady_clock::time_point last {std::chrono::steady_clock::now()};
+};
+
+/*
+ * Coalesces identical requests that are in flight at the same time: the first
+ * caller of a key runs the work and every caller that arrives before it
+ * finishes waits for the same result, or the same evalError, until its own
+ * deadline. Keys are forgotten once their work is done, so a later request
+ * runs again and sees the definitions made since.
+ */
+class singleFlight {
+public:
+    template <typename F>
+    std::string run(const std::string &key, F work, const cancellation &deadline) {
+        std::unique_lock lock {mutex};
+
+        if (const auto flight {flights.find(key)}; flight != flights.end()) {
+            const std::shared_future<std::string> result {flight->second};
+            lock.unlock();
+
+            if (deadline.deadline != std::chrono::steady_clock::time_point::max()
+                && result.wait_until(deadline.deadline) == std::future_status::timeout) {
+                fail("Deadline exceeded");
+            }
+
+            return result.get();
+        }
+
+        std::promise<std::string> promise {};
+        const std::shared_future<std::string> result {promise.get_future().share()};
+        flights.emplace(key, result);
+        lock.unlock();
+
+        try {
+            promise.set_value(work());
+        }
+        catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+
+        lock.lock();
+        flights.erase(key);
+        lock.unlock();
+
+        return result.get();
+    }
+
+private:
+    std::mutex mutex {};
+    std::unordered_map<std::string, std::shared_future<std::string>> flights {};
+};
+
+/* State shared by the connections of --serve. The environment is not thread safe, so evaluations take turns. */
+class server {
+public:
+    server(environment &env, const char *_snapshotPath, recorder *_log, std::chrono::milliseconds _timeout)
+            : lexer {env}, snapshotPath {_snapshotPath}, log {_log}, timeout {_timeout} {}
+
+    /*
+     * Evaluates one request line, or defines a variable or function, as the
+     * REPL would. save writes the --snapshot file. With a --timeout, the
+     * evaluation is abandoned once the request is that old, waiting for its
+     * turn included, and its waiters get the error; a waiter that joined
+     * later gives up on its own once its request is that old.
+     *
+     * Only expressions without random variables are coalesced, and only with
+     * requests that arrived after the same definition; definitions, save and
+     * random draws always run on their own.
+     */
+    std::string answer(const std::string &line) {
+        if (log != nullptr) {
+            log->record(line);
+        }
+
+        const cancellation deadline {timeout.count() > 0 ? cancellation {timeout} : cancellation {}};
+
+        const auto run {[&] {
+            const std::lock_guard lock {evaluating};
+            const cancellationScope scope {&deadline};
+
+            if (line == "save" && snapshotPath != nullptr) {
+                snapshot::save(snapshotPath, lexer.getEnvironment());
+                return std::string {"Saved."};
+            }
+
+            if (define(lexer, line)) {
+                ++definitions;
+                return std::string {"Defined."};
+            }
+
+            return evaluate(lexer, line);
+        }};
+
+        if (line == "save" || findAssignment(line) != std::string::npos) {
+            return run();
+        }
+
+        const uint64_t generation {definitions};
+        bool random {};
+        {
+            const std::lock_guard lock {evaluating};
+            const cancellationScope scope {&deadline};
+            const std::shared_ptr<const cachedProgram> program {compileCached(lexer, line)};
+            random = program != nullptr && drawsRandom(program->compiled);
+        }
+
+        return random ? run() : flights.run(std::to_string(generation) + ' ' + line, run, deadline);
+    }
+
+private:
+    lexana lexer;
+    const char *snapshotPath;
+    recorder *log;
+    std::chrono::milliseconds timeout;
+    std::mutex evaluating {};
+    std::atomic<uint64_t> definitions {0}; // Part of the single flight key, so requests after a definition never share a result from before it.
+    singleFlight flights {};
+};
+
+/*
+ * Answers the lines of one client until it disconnects or sends exit. Errors
+ * are answered with "error: " and the message; that includes any exception
+ * other than evalError, so that no request can end the server.
+ */
+void serveConnection(server &s, int client) {
+    std::string pending {};
+    char buffer[4096];
 
-    while (!formatted.empty()) {
-        const token &t {formatted.front()};
-        formatted.pop_front();
-        switch (t.type) {
-            case tokenType::nil: break;
+    while (true) {
+        const ssize_t received {recv(client, buffer, sizeof buffer, 0)};
+        if (received <= 0) {
+            break;
+        }
 
-            case tokenType::i32:
-                stack.push_back((float)t.intData);
-                break;
+        pending.append(buffer, (size_t)received);
 
-            case tokenType::f32:
-                stack.push_back(t.fltData);
+        size_t end {};
+        bool done {false};
+        while (!done && (end = pending.find('\n')) != std::string::npos) {
+            std::string line {pending.substr(0, end)};
+            pending.erase(0, end + 1);
+
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+
+            if (line == "exit") {
+                done = true;
                 break;
+            }
 
-            case tokenType::add:
-            case tokenType::sub:
-            case tokenType::mul:
-            case tokenType::div:
-            case tokenType::mod:
-            case tokenType::exp:
-                if (t.unary) {
-                    float &rhs {stack.back()};
-                    rhs *= -1;
+            std::string reply {};
+            try {
+                reply = s.answer(line) + '\n';
+            }
+            catch (const std::exception &e) {
+                reply = std::string {"error: "} + e.what() + '\n';
+            }
+
+            for (size_t sent {0}; sent < reply.size();) {
+                const ssize_t n {send(client, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL)};
+                if (n <= 0) {
+                    done = true;
+                    break;
                 }
-                else {
-                    const float rhs {stack.back()};
-                    stack.pop_back();
-                    const float lhs {stack.back()};
-                    stack.pop_back();
+                sent += (size_t)n;
+            }
+        }
 
-                    switch (t.type) {
-                        case tokenType::exp:
-                            stack.push_back(std::pow(lhs, rhs));
-                            break;
+        if (done) {
+            break;
+        }
+    }
 
-                        case tokenType::mul:
-                            stack.push_back(lhs * rhs);
-                            break;
+    close(client);
+}
 
-                        case tokenType::div:
-                            stack.push_back(lhs / rhs);
-                            break;
+/*
+ * --serve <port>: answers expressions, one per line, on a TCP port of the
+ * loopback interface with a thread per connection. A client sending save
+ * writes the --snapshot file, if there is one.
+ */
+int runServer(environment &env, int port, const char *snapshotPath, recorder *log, std::chrono::milliseconds timeout) {
+    const int listener {socket(AF_INET, SOCK_STREAM, 0)};
+    if (listener < 0) {
+        std::cerr << "Cannot create a socket\n";
+        return 1;
+    }
 
-                        case tokenType::add:
-                            stack.push_back(lhs + rhs);
-                            break;
+    const int reuse {1};
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
 
-                        case tokenType::sub:
-                            stack.push_back(lhs - rhs);
-                            break;
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons((uint16_t)port);
 
-                        default: break;
-                    }
+    if (bind(listener, (const sockaddr *)&address, sizeof address) < 0 || listen(listener, SOMAXCONN) < 0) {
+        std::cerr << "Cannot listen on port " << port << '\n';
+        close(listener);
+        return 1;
+    }
+
+    server s {env, snapshotPath, log, timeout};
+
+    while (true) {
+        const int client {accept(listener, nullptr, nullptr)};
+        if (client < 0) {
+            continue;
+        }
+
+        std::thread {serveConnection, std::ref(s), client}.detach();
+    }
+}
+
+/*
+ * --replay <file> [--speed <x>]: sends a --record log through a fresh
+ * environment in the recorded mode, keeping the recorded gaps divided by
+ * speed, or none at all for speed 0, and prints throughput and latency.
+ * Latency runs from when a line was due if the one before was still
+ * running then, so a replay that falls behind reports the queueing its
+ * clients would have seen, and otherwise from when it started, so that
+ * oversleeping is not counted. Results are dropped.
+ */
+int runReplay(const std::string &path, double speed) {
+    using clock = std::chrono::steady_clock;
+
+    std::ifstream file {path, std::ios::binary};
+    uint64_t header[2] {};
+    if (!file.read((char *)header, sizeof header) || header[0] != recorder::formatMagic) {
+        std::cerr << "Not a recording of this version: " << path << '\n';
+        return 1;
+    }
+
+    environment env {};
+    env.mode = (evalMode)(header[1] >> 32);
+    env.scale = (int)(uint32_t)header[1];
+    lexana lexer {env};
+
+    const auto varint {[&](uint64_t &value) {
+        value = 0;
+        for (int shift {0}; shift < 64; shift += 7) {
+            const int c {file.get()};
+            if (c == EOF) return false;
+            value |= (uint64_t)(c & 0x7f) << shift;
+            if (c < 0x80) return true;
+        }
+        return false;
+    }};
+
+    std::vector<double> latencies {};
+    size_t errors {0};
+    const clock::time_point start {clock::now()};
+    const auto elapsed {[&] { return std::chrono::duration<double> {clock::now() - start}.count(); }};
+    double due {0.0}, finished {0.0}; // Seconds after start.
+    uint64_t gap {}, size {};
+
+    while (varint(gap) && varint(size)) {
+        std::string line(size, '\0');
+        if (!file.read(line.data(), (std::streamsize)size)) {
+            break;
+        }
+
+        if (speed > 0.0) {
+            due += (double)gap * 1e-9 / speed;
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double> {due}));
+        }
+
+        const double from {speed > 0.0 && finished > due ? due : elapsed()};
+
+        try {
+            if (!define(lexer, line)) {
+                evaluate(lexer, line);
+            }
+        }
+        catch (const evalError &) {
+            ++errors;
+        }
+
+        finished = elapsed();
+        latencies.push_back(finished - from);
+    }
+
+    const double seconds {elapsed()};
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile {[&](double p) {
+        return latencies.empty() ? 0.0 : latencies[std::min(latencies.size() - 1, (size_t)(p * (double)latencies.size()))] * 1e6;
+    }};
+
+    std::cout << "requests   " << latencies.size() << '\n'
+              << "errors     " << errors << '\n'
+              << "seconds    " << seconds << '\n'
+              << "per second " << (double)latencies.size() / seconds << '\n'
+              << "p50 us     " << percentile(0.5) << '\n'
+              << "p90 us     " << percentile(0.9) << '\n'
+              << "p99 us     " << percentile(0.99) << '\n'
+              << "max us     " << percentile(1.0) << '\n';
+
+    return 0;
+}
+
+/*
+ * The REPL for a stdin that is not a terminal: no prompts, one line of
+ * output per line of input (Defined. for a definition, an empty line for an
+ * empty one) until the end of input or exit. Input is read and output
+ * written in large blocks, bypassing stdio; output written so far is flushed
+ * before an error ends the run.
+ */
+void runPipe(environment &env, recorder *log) {
+    std::ios::sync_with_stdio(false);
+    std::cin.tie(nullptr);
+
+    constexpr size_t blockSize {1 << 16};
+    lexana lexer {env};
+    std::string input {}, output {};
+    std::vector<char> block(blockSize);
+    bool more {true};
+
+    try {
+        while (more) {
+            const std::streamsize read {std::cin.rdbuf()->sgetn(block.data(), (std::streamsize)blockSize)};
+            more = read > 0;
+            input.append(block.data(), (size_t)std::max<std::streamsize>(read, 0));
+
+            /* At the end of input the last line may lack its newline. */
+            size_t begin {0};
+            for (size_t end {input.find('\n')}; end != std::string::npos || (!more && begin < input.size());
+                 end = input.find('\n', begin)) {
+                const std::string line {input.substr(begin, (end == std::string::npos ? input.size() : end) - begin)};
+                begin = end == std::string::npos ? input.size() : end + 1;
+
+                if (line == "exit" || line == "exit\r") {
+                    more = false;
+                    break;
                 }
-                break;
 
-            default: break;
+                if (log != nullptr) {
+                    log->record(line);
+                }
+
+                if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                    output += '\n';
+                }
+                else if (define(lexer, line)) {
+                    output += "Defined.\n";
+                }
+                else {
+                    output += evaluate(lexer, line);
+                    output += '\n';
+                }
+
+                if (output.size() >= blockSize) {
+                    std::cout.write(output.data(), (std::streamsize)output.size());
+                    output.clear();
+                }
+            }
+
+            input.erase(0, begin);
         }
     }
+    catch (const evalError &) {
+        std::cout.write(output.data(), (std::streamsize)output.size());
+        std::cout.flush();
+        throw;
+    }
 
-    return stack.back();
+    std::cout.write(output.data(), (std::streamsize)output.size());
+    std::cout.flush();
 }
 
-int main() {
-    std::string exprStr {};
-    lexana *lexer {new lexana {}};
+/* Calls fn repeatedly for about 50ms and returns the mean nanoseconds per call. */
+template <typename F>
+double timePerCall(F fn) {
+    using clock = std::chrono::steady_clock;
+    size_t calls {0};
+    const auto start {clock::now()};
+    auto elapsed {clock::duration {}};
 
-    while (true) {
-        std::cout << "Enter an mathematical expression ('exit' to stop): ";
-        std::getline(std::cin, exprStr);
-        std::cout << '\n';
+    while (elapsed < std::chrono::milliseconds {50}) {
+        for (size_t i {0}; i < 16; ++i) fn();
+        calls += 16;
+        elapsed = clock::now() - start;
+    }
 
-        if (exprStr == "exit") {
-            break;
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / (double)calls;
+}
+
+void benchBignum() {
+    std::mt19937 rng {42};
+    const auto randomBig {[&](size_t limbs) {
+        magnitude m(limbs);
+        for (uint32_t &limb: m) limb = rng();
+        m.back() |= 1u << 31;
+        return fromMagnitude(m, false);
+    }};
+
+    std::cout << "limbs      add ns   schoolbook mul ns   karatsuba mul ns\n";
+    for (const size_t limbs: {1, 2, 4, 16, 64, 256, 1024, 4096}) {
+        const bigint a {limbs == 1 ? bigint {(int64_t)(rng() >> 1)} : randomBig(limbs)};
+        const bigint b {limbs == 1 ? bigint {(int64_t)(rng() >> 1)} : randomBig(limbs)};
+        volatile size_t sink {};
+
+        const double add {timePerCall([&] { sink = bigAdd(a, b).limbs.size(); })};
+        const double school {timePerCall([&] {
+            bool negative {};
+            sink = schoolbookMul(magnitudeOf(a, negative), magnitudeOf(b, negative)).size();
+        })};
+        const double karatsuba {timePerCall([&] { sink = bigMul(a, b).limbs.size(); })};
+
+        std::cout << std::setw(5) << limbs << std::setw(12) << std::fixed << std::setprecision(1) << add
+                  << std::setw(20) << school << std::setw(19) << karatsuba << '\n';
+    }
+
+    std::cout << "\nexponent        2^n ns\n";
+    for (const int64_t n: {10, 62, 200, 2000, 20000, 200000}) {
+        volatile size_t sink {};
+        const double pow {timePerCall([&] { sink = bigPow(2, n).limbs.size(); })};
+        std::cout << std::setw(8) << n << std::setw(14) << pow << '\n';
+    }
+}
+
+/*
+ * Throughput of each batch expression with the exact and the --approx
+ * kernels, and the largest difference between them: relative, or absolute
+ * where the exact result is below 1 in magnitude.
+ */
+void benchApprox() {
+    constexpr size_t rows {1 << 14};
+    std::mt19937 rng {42};
+    std::uniform_real_distribution<float> xs {0.1f, 10.0f}, ys {0.5f, 3.0f};
+    std::vector<float> x(rows), y(rows);
+
+    for (size_t r {0}; r < rows; ++r) {
+        x[r] = xs(rng);
+        y[r] = ys(rng);
+    }
+
+    std::cout << "expression              exact ns/row   approx ns/row   speedup     max error\n";
+    for (const char *expr: {"x ^ y", "exp(y) + log(x)", "sin(x) * cos(y)", "(x ^ 2 + y) / (x + 1)", "x * exp(-y) + sin(x)"}) {
+        environment env {};
+        lexana lexer {env};
+        const std::deque<token> formatted {compile(lexer, expr)};
+        const std::vector<const float *> columns {x.data(), y.data()};
+
+        const std::vector<float> exact {computeBatch(formatted, columns, rows)};
+        const std::vector<float> approx {computeBatch(formatted, columns, rows, true)};
+        double error {0.0};
+        for (size_t r {0}; r < rows; ++r) {
+            error = std::max(error, std::fabs((double)approx[r] - exact[r]) / std::max(std::fabs((double)exact[r]), 1.0));
+        }
+
+        volatile float sink {};
+        const double exactNs {timePerCall([&] { sink = computeBatch(formatted, columns, rows)[0]; }) / rows};
+        const double approxNs {timePerCall([&] { sink = computeBatch(formatted, columns, rows, true)[0]; }) / rows};
+
+        std::cout << std::left << std::setw(22) << expr << std::right << std::fixed << std::setprecision(3)
+                  << std::setw(14) << exactNs << std::setw(16) << approxNs << std::setprecision(2)
+                  << std::setw(10) << exactNs / approxNs << std::scientific << std::setprecision(1)
+                  << std::setw(14) << error << std::defaultfloat << '\n';
+    }
+}
+
+/* Dispatches and time per scalar evaluation of each expression, before and after fuse. */
+void benchDispatch() {
+    std::mt19937 rng {42};
+    std::uniform_real_distribution<float> values {0.5f, 2.0f};
+
+    std::cout << "expression                              dispatches   fused   plain ns   fused ns   speedup\n";
+    for (const char *expr: {"a * x + b", "2 * x * x + 3 * x + 1", "(x - 1) * (x + 1) / 4", "a * x * x * x + b * x * x + c * x + d",
+                            "x > 1 ? x * 2 + 1 : a - x", "sqrt(x * x + y * y) * 0.5 + 1"}) {
+        environment env {};
+        lexana lexer {env};
+        const std::deque<token> plain {lowerBranches(compile(lexer, expr))};
+        const std::deque<token> fused {fuse(plain)};
+
+        std::vector<float> bindings(env.variables.size());
+        for (float &value: bindings) value = values(rng);
+
+        volatile float sink {};
+        const double plainNs {timePerCall([&] { sink = compute(plain, bindings); })};
+        const double fusedNs {timePerCall([&] { sink = compute(fused, bindings); })};
+
+        std::cout << std::left << std::setw(40) << expr << std::right << std::setw(10) << plain.size() << std::setw(8) << fused.size()
+                  << std::fixed << std::setprecision(1) << std::setw(11) << plainNs << std::setw(11) << fusedNs
+                  << std::setprecision(2) << std::setw(10) << plainNs / fusedNs << std::defaultfloat << '\n';
+    }
+}
+
+/*
+ * Time per decimal evaluation of each expression at scale 2, and what
+ * parsing its literals from their text would add to every evaluation;
+ * compileParsed does that once.
+ */
+void benchDecimal() {
+    std::cout << "expression                              eval ns   literal parse ns\n";
+    for (const char *expr: {"1.05 * 100", "19.99 * 3 + 4.50 - 0.01", "(1250.00 - 12.50) * 0.0725 / 12",
+                            "max(0.10, 2.345 * 1.5) + abs(0 - 7.125)", "1.01 ^ 12 * 1000"}) {
+        environment env {};
+        env.mode = evalMode::decimal;
+        env.scale = 2;
+        lexana lexer {env};
+        const std::deque<token> formatted {compile(lexer, expr)};
+
+        volatile int64_t sink {};
+        const double evalNs {timePerCall([&] { sink = computeDecimal(formatted, env.scale); })};
+        const double parseNs {timePerCall([&] {
+            for (const token &t: formatted) {
+                if (t.type == tokenType::i32 || t.type == tokenType::f32) sink = decimalLiteral(t, env.scale);
+            }
+        })};
+
+        std::cout << std::left << std::setw(40) << expr << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(7) << evalNs << std::setw(19) << parseNs << std::defaultfloat << '\n';
+    }
+}
+
+/* --bench <suite>: micro benchmarks printed as tables. */
+int runBenchmarks(const std::string &suite) {
+    if (suite == "approx") {
+        benchApprox();
+        return 0;
+    }
+
+    if (suite == "bignum") {
+        benchBignum();
+        return 0;
+    }
+
+    if (suite == "decimal") {
+        benchDecimal();
+        return 0;
+    }
+
+    if (suite == "dispatch") {
+        benchDispatch();
+        return 0;
+    }
+
+    std::cerr << "Unknown benchmark: " << suite << '\n';
+    return 1;
+}
+
+/* Name of t as an instruction in --profile-corpus: literals, variables and negation by kind, builtins by name. */
+std::string opcodeName(const token &t) {
+    switch (t.type) {
+        case tokenType::i32:
+        case tokenType::f32:
+            return "lit";
+
+        case tokenType::var:
+            return "var";
+
+        case tokenType::fun:
+        case tokenType::form:
+            return t.strData;
+
+        default:
+            return t.unary ? "neg" : token::typeName(t.type);
+    }
+}
+
+/*
+ * --profile-corpus <file>: compiles each line of a file of expressions as the
+ * scalar evaluator runs it and prints the most frequent instruction pairs and
+ * triples, the superinstruction fuse turns each into if any, and how many
+ * dispatches fusion saves over the whole corpus. Definitions are run so
+ * later lines can use them.
+ */
+int runProfileCorpus(environment &env, const std::string &path) {
+    std::ifstream file {path};
+    if (!file) {
+        std::cerr << "Cannot open " << path << '\n';
+        return 1;
+    }
+
+    lexana lexer {env};
+    std::unordered_map<std::string, size_t> pairs {}, triples {};
+    std::unordered_map<std::string, std::string> fusedAs {};
+    size_t before {0}, after {0}, expressions {0};
+
+    for (std::string line {}; std::getline(file, line);) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos || define(lexer, line)) {
+            continue;
+        }
+
+        const std::deque<token> compiled {compile(lexer, line)};
+        if (containsArray(compiled)) {
+            continue;
         }
 
-        lexer->lex(exprStr);
+        const std::deque<token> program {lowerBranches(compiled)};
+        before += program.size();
+        after += fuse(program).size();
+        ++expressions;
 
-        std::deque<token> formatted {shuntingYard(lexer->getTokens())};
+        for (size_t pc {0}; pc < program.size(); ++pc) {
+            for (size_t length: {2, 3}) {
+                if (pc + length > program.size()) {
+                    continue;
+                }
 
-        const float expr {compute(formatted)};
+                const std::deque<token> window(program.begin() + (long)pc, program.begin() + (long)(pc + length));
+                std::string name {};
+                for (const token &t: window) {
+                    name += (name.empty() ? "" : " ") + opcodeName(t);
+                }
 
-        std::cout << "That evaluates out to:\n" << expr << "\n\n";
+                ++(length == 2 ? pairs : triples)[name];
 
-        lexer->getTokens().clear();
+                /* Jumps in a window may point outside it, so only jump free windows are fused on their own. */
+                if (!fusedAs.count(name) && std::none_of(window.begin(), window.end(), [](const token &t) {
+                        return t.type == tokenType::jz || t.type == tokenType::jmp;
+                    })) {
+                    const std::deque<token> fused {fuse(window)};
+                    fusedAs[name] = fused.size() == 1 ? token::typeName(fused[0].type) : "";
+                }
+            }
+        }
     }
 
-    delete lexer;
+    std::cout << "expressions   " << expressions << '\n'
+              << "dispatches    " << before << '\n'
+              << "fused         " << after << " (" << std::fixed << std::setprecision(1)
+              << (before == 0 ? 0.0 : 100.0 * (double)(before - after) / (double)before) << "% fewer)\n";
+
+    for (const auto &[title, counts]: {std::pair {"pairs", &pairs}, std::pair {"triples", &triples}}) {
+        std::vector<std::pair<size_t, std::string>> ranked {};
+        size_t total {0};
+        for (const auto &[name, count]: *counts) {
+            ranked.emplace_back(count, name);
+            total += count;
+        }
+
+        std::sort(ranked.begin(), ranked.end(), [](const auto &a, const auto &b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+
+        std::cout << '\n' << std::left << std::setw(24) << title << std::right << std::setw(10) << "count"
+                  << std::setw(9) << "share" << "  fused\n";
+        for (size_t i {0}; i < std::min<size_t>(ranked.size(), 12); ++i) {
+            std::cout << std::left << std::setw(24) << ranked[i].second << std::right << std::setw(10) << ranked[i].first
+                      << std::setw(8) << 100.0 * (double)ranked[i].first / (double)total << "%  " << fusedAs[ranked[i].second] << '\n';
+        }
+    }
 
+    std::cout << std::defaultfloat;
     return 0;
 }
+
+int main(int argc, char **argv) {
+    environment env {};
+    const char *batchExpr {nullptr};
+    const char *batchFile {nullptr};
+    const char *batchFormat {nullptr};
+    const char *monteCarloExpr {nullptr};
+    size_t samples {0};
+    uint64_t seed {0};
+    int port {-1};
+    const char *snapshotPath {nullptr};
+    const char *recordPath {nullptr};
+    const char *replayPath {nullptr};
+    double speed {1.0};
+    std::chrono::milliseconds timeout {0};
+    const char *corpusPath {nullptr};
+    std::unique_ptr<sharedCache> shared {};
+
+    for (int i {1}; i < argc; ++i) {
+        const std::string flag {argv[i]};
+
+        if (flag == "--batch" && i + 1 < argc) {
+            batchExpr = argv[++i];
+        }
+        else if (flag == "--batch-file" && i + 1 < argc) {
+            batchFile = argv[++i];
+        }
+        else if (flag == "--serve" && i + 1 < argc) {
+            port = std::atoi(argv[++i]);
+
+            if (port <= 0 || port > 65535) {
+                std::cerr << "Port must be between 1 and 65535\n";
+                return 1;
+            }
+        }
+        else if (flag == "--montecarlo" && i + 2 < argc) {
+            samples = std::strtoull(argv[++i], nullptr, 10);
+            monteCarloExpr = argv[++i];
+        }
+        else if (flag == "--seed" && i + 1 < argc) {
+            seed = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (flag == "--format" && i + 1 < argc) {
+            batchFormat = argv[++i];
+        }
+        else if (flag == "--bench" && i + 1 < argc) {
+            return runBenchmarks(argv[i + 1]);
+        }
+        else if (flag == "--snapshot" && i + 1 < argc) {
+            snapshotPath = argv[++i];
+        }
+        else if (flag == "--record" && i + 1 < argc) {
+            recordPath = argv[++i];
+        }
+        else if (flag == "--replay" && i + 1 < argc) {
+            replayPath = argv[++i];
+        }
+        else if (flag == "--profile-corpus" && i + 1 < argc) {
+            corpusPath = argv[++i];
+        }
+        else if (flag == "--timeout" && i + 1 < argc) {
+            timeout = std::chrono::milliseconds {std::atoll(argv[++i])};
+        }
+        else if (flag == "--speed" && i + 1 < argc) {
+            speed = std::atof(argv[++i]);
+        }
+        else if (flag == "--shm-cache") {
+            shared = sharedCache::attach();
+
+            if (shared == nullptr) {
+                std::cerr << "Shared memory cache unavailable\n";
+                return 1;
+            }
+
+            env.programs.shared = shared.get();
+        }
+        else if (flag == "--approx") {
+            env.approx = true;
+        }
+        else if (flag == "--bignum") {
+            env.mode = evalMode::bignum;
+        }
+        else if (flag == "--complex") {
+            env.mode = evalMode::complex;
+        }
+        else if (flag == "--decimal" && i + 1 < argc) {
+            env.mode = evalMode::decimal;
+            env.scale = std::atoi(argv[++i]);
+
+            if (env.scale < 0 || env.scale > maxScale) {
+                std::cerr << "Decimal scale must be between 0 and " << maxScale << '\n';
+                return 1;
+            }
+        }
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--batch <expression> [--format f16|bf16] | --batch-file <path> | --serve <port> [--timeout <ms>] | --shm-cache | --snapshot <file> | --record <file> | --replay <file> [--speed <x>] | --montecarlo <samples> <expression> [--seed <n>] | --bench <suite> | --profile-corpus <file> | --decimal <scale> | --bignum | --complex | --approx]\n";
+            return 1;
+        }
+    }
+
+    /* Errors end the command line modes; only the server answers them and goes on. */
+    if (replayPath != nullptr) {
+        return runReplay(replayPath, speed);
+    }
+
+    try {
+        /* Restored before any mode runs; the REPL and --batch-file save it again when they finish, the server on request. */
+        const std::unique_ptr<snapshot> restored {snapshotPath != nullptr ? snapshot::open(snapshotPath) : nullptr};
+        if (restored != nullptr) {
+            restored->restore(env);
+            env.programs.restored = restored.get();
+        }
+
+        const std::unique_ptr<recorder> log {recordPath != nullptr ? std::make_unique<recorder>(recordPath, env) : nullptr};
+
+        if (corpusPath != nullptr) {
+            return runProfileCorpus(env, corpusPath);
+        }
+
+        if (port >= 0) {
+            return runServer(env, port, snapshotPath, log.get(), timeout);
+        }
+
+        if (monteCarloExpr != nullptr) {
+            return runMonteCarlo(env, monteCarloExpr, samples, seed);
+        }
+
+        if (batchFormat != nullptr) {
+            const std::string name {batchFormat};
+
+            if (batchExpr == nullptr || (name != "f16" && name != "bf16")) {
+                std::cerr << "--format takes f16 or bf16 and needs --batch\n";
+                return 1;
+            }
+
+            return runHalfBatch(env, batchExpr, name == "f16" ? storage::f16 : storage::bf16);
+        }
+
+        if (batchExpr != nullptr) {
+            return runBatch(env, batchExpr);
+        }
+
+        if (batchFile != nullptr) {
+            const int status {runBatchFile(env, batchFile)};
+            if (status == 0 && snapshotPath != nullptr) {
+                snapshot::save(snapshotPath, env);
+            }
+            return status;
+        }
+
+        if (isatty(STDIN_FILENO) == 0) {
+            runPipe(env, log.get());
+        }
+        else {
+            std::string exprStr {};
+            lexana *lexer {new lexana {env}};
+
+            while (true) {
+                std::cout << "Enter an mathematical expression ('exit' to stop): ";
+                std::getline(std::cin, exprStr);
+                std::cout << '\n';
+
+                if (exprStr == "exit") {
+                    break;
+                }
+
+                if (log != nullptr) {
+                    log->record(exprStr);
+                }
+
+                if (define(*lexer, exprStr)) {
+                    std::cout << "Defined.\n\n";
+                    continue;
+                }
+
+                std::cout << "That evaluates out to:\n" << evaluate(*lexer, exprStr) << "\n\n";
+            }
+
+            delete lexer;
+        }
+
+        if (snapshotPath != nullptr) {
+            snapshot::save(snapshotPath, env);
+        }
+
+        return 0;
+    }
+    catch (const evalError &e) {
+        std::cerr << e.what() << '\n';
+        return 1;
+    }
+}
+
+#endif
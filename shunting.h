@@ -0,0 +1,86 @@
+/*
+ * C interface of the calculator, built from Evaluator.cpp as a library:
+ *
+ *     g++ -std=c++20 -O2 -pthread -shared -fPIC -DSHUNTING_LIBRARY -o libshunting.so Evaluator.cpp
+ *
+ * Expressions are evaluated in float. Nothing here writes to stdout or
+ * stderr or ends the process: functions that can fail return 0 or a null
+ * pointer and leave a message in shunting_error. A context and the programs
+ * compiled in it are used by one thread at a time; separate contexts are
+ * independent.
+ */
+
+#ifndef SHUNTING_H
+#define SHUNTING_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct shunting_context shunting_context;
+typedef struct shunting_program shunting_program;
+
+/* Variables, their values and user functions, as in a REPL session. Null if out of memory. */
+shunting_context *shunting_create(void);
+void shunting_destroy(shunting_context *context);
+
+/* Message of the last failure in context, or "" if the last call succeeded. */
+const char *shunting_error(const shunting_context *context);
+
+/*
+ * Makes every later call on context fail with "Deadline exceeded" once it
+ * has run for milliseconds; 0, the default, means no limit.
+ */
+void shunting_set_timeout(shunting_context *context, unsigned long milliseconds);
+
+/*
+ * Makes the call in progress on context fail with "Cancelled" at its next
+ * check, which long loops make every few microseconds. The only function
+ * that may be called from another thread while context is in use; it does
+ * nothing if no call or operation is in progress.
+ */
+void shunting_cancel(shunting_context *context);
+
+/*
+ * Makes the calls on context until shunting_end_operation one operation,
+ * such as a batch evaluated in several slices: its timeout runs from here
+ * rather than from each call, and a cancel between calls fails the next.
+ */
+void shunting_begin_operation(shunting_context *context);
+void shunting_end_operation(shunting_context *context);
+
+/* Runs a definition such as "a = 2" or "f(x) = x ^ 2 + 1". Returns 1 on success. */
+int shunting_define(shunting_context *context, const char *definition);
+
+/*
+ * Compiles a scalar expression. The variables it reads that have no value
+ * yet are bound by position when it is evaluated, in the order
+ * shunting_variable_name lists them; the others keep the values
+ * shunting_define gave them.
+ */
+shunting_program *shunting_compile(shunting_context *context, const char *expression);
+void shunting_free(shunting_program *program);
+
+size_t shunting_variable_count(const shunting_program *program);
+const char *shunting_variable_name(const shunting_program *program, size_t index);
+
+/*
+ * Evaluates program with bindings[i] for its variable i; bindings may be
+ * null if it has none. Returns 1 on success.
+ */
+int shunting_evaluate(shunting_context *context, const shunting_program *program, const float *bindings, float *result);
+
+/*
+ * Evaluates program for rows rows at once, with columns[i][row] for its
+ * variable i, into results[row]. Returns 1 on success.
+ */
+int shunting_evaluate_batch(shunting_context *context, const shunting_program *program, const float *const *columns,
+                            size_t rows, float *results);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
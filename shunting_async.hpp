@@ -0,0 +1,227 @@
+/*
+ * C++20 coroutine interface over the C library of shunting.h, for services
+ * that must not block their event loop threads:
+ *
+ *     shunting_program *program {co_await shunting::compile(pool, loop, context, "a * x + y")};
+ *     int ok {co_await shunting::evaluateBatch(pool, loop, context, program, columns, rows, results)};
+ *
+ * Compiling and large batches run on a workerPool. Smaller batches run on
+ * loop in slices, returning to it between slices, so a long evaluation does
+ * not hold up other work there. Either way the awaiting coroutine resumes
+ * through loop, the function that queues work on the caller's event loop;
+ * an empty loop resumes it on whichever thread finished. Results and errors
+ * are those of the C functions; shunting_error has the message. The timeout
+ * of shunting_set_timeout covers a sliced batch as a whole. A context is
+ * still used by one operation at a time.
+ */
+
+#ifndef SHUNTING_ASYNC_HPP
+#define SHUNTING_ASYNC_HPP
+
+#include "shunting.h"
+
+#include <algorithm>          // min
+#include <condition_variable> // condition_variable
+#include <coroutine>          // coroutine_handle
+#include <deque>              // deque
+#include <functional>         // function
+#include <mutex>              // mutex
+#include <string>             // string
+#include <thread>             // thread
+#include <vector>             // vector
+
+namespace shunting {
+
+/* Queues a piece of work to run later, on some thread. */
+using executor = std::function<void(std::function<void()>)>;
+
+/* Batches of at least this many rows go to the pool; smaller ones are sliced on the loop. */
+constexpr size_t offloadRows {1 << 16};
+constexpr size_t sliceRows {1 << 12};
+
+/* Threads that run queued work in order of arrival until the pool is destroyed. */
+class workerPool {
+public:
+    explicit workerPool(size_t threads = std::max(1u, std::thread::hardware_concurrency())) {
+        for (size_t t {0}; t < threads; ++t) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    workerPool(const workerPool &) = delete;
+    workerPool &operator=(const workerPool &) = delete;
+
+    /* Runs the work already queued, then joins. */
+    ~workerPool() {
+        {
+            const std::lock_guard lock {mutex};
+            stopping = true;
+        }
+
+        ready.notify_all();
+        for (std::thread &t: workers) {
+            t.join();
+        }
+    }
+
+    void post(std::function<void()> fn) {
+        {
+            const std::lock_guard lock {mutex};
+            queue.push_back(std::move(fn));
+        }
+
+        ready.notify_one();
+    }
+
+    executor asExecutor() {
+        return [this](std::function<void()> fn) { post(std::move(fn)); };
+    }
+
+private:
+    void work() {
+        while (true) {
+            std::unique_lock lock {mutex};
+            ready.wait(lock, [this] { return stopping || !queue.empty(); });
+
+            if (queue.empty()) {
+                return;
+            }
+
+            std::function<void()> fn {std::move(queue.front())};
+            queue.pop_front();
+            lock.unlock();
+            fn();
+        }
+    }
+
+    std::mutex mutex {};
+    std::condition_variable ready {};
+    std::deque<std::function<void()>> queue {};
+    std::vector<std::thread> workers {};
+    bool stopping {false};
+};
+
+inline void resumeOn(const executor &loop, std::coroutine_handle<> awaiting) {
+    if (loop) {
+        loop([awaiting] { awaiting.resume(); });
+    }
+    else {
+        awaiting.resume();
+    }
+}
+
+/* Awaitable of compile: the program, or null on failure. */
+class compileOperation {
+public:
+    compileOperation(workerPool &_pool, executor _loop, shunting_context *_context, std::string _expression)
+            : pool {_pool}, loop {std::move(_loop)}, context {_context}, expression {std::move(_expression)} {}
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    /* Resuming may destroy this awaitable, so the work copies loop and touches no member after handing off. */
+    void await_suspend(std::coroutine_handle<> awaiting) {
+        pool.post([this, awaiting, loop {loop}] {
+            program = shunting_compile(context, expression.c_str());
+            resumeOn(loop, awaiting);
+        });
+    }
+
+    shunting_program *await_resume() const noexcept {
+        return program;
+    }
+
+private:
+    workerPool &pool;
+    executor loop;
+    shunting_context *context;
+    std::string expression;
+    shunting_program *program {};
+};
+
+/* Awaitable of evaluateBatch: 1 on success, 0 on failure, as shunting_evaluate_batch. */
+class batchOperation {
+public:
+    batchOperation(workerPool &_pool, executor _loop, shunting_context *_context, const shunting_program *_program,
+                   std::vector<const float *> _columns, size_t _rows, float *_results)
+            : pool {_pool}, loop {std::move(_loop)}, context {_context}, program {_program},
+              columns {std::move(_columns)}, rows {_rows}, results {_results} {}
+
+    bool await_ready() const noexcept {
+        return rows == 0;
+    }
+
+    /*
+     * Resuming may destroy this awaitable, from the moment the work is queued
+     * if loop runs it on another thread; so loop and the handle are copied
+     * first and no member is touched after handing off.
+     */
+    void await_suspend(std::coroutine_handle<> awaiting) {
+        waiting = awaiting;
+
+        if (rows >= offloadRows || !loop) {
+            pool.post([this, awaiting, loop {loop}] {
+                status = shunting_evaluate_batch(context, program, columns.data(), rows, results);
+                resumeOn(loop, awaiting);
+            });
+            return;
+        }
+
+        shunting_begin_operation(context);
+        const executor next {loop};
+        next([this] { slice(); });
+    }
+
+    int await_resume() const noexcept {
+        return status;
+    }
+
+private:
+    /* Evaluates the next sliceRows rows on the loop, then queues the rest behind whatever else is waiting there. */
+    void slice() {
+        const size_t count {std::min(sliceRows, rows - done)};
+        std::vector<const float *> offset {columns};
+        for (const float *&column: offset) {
+            column += done;
+        }
+
+        status = shunting_evaluate_batch(context, program, offset.data(), count, results + done);
+        done += count;
+
+        if (status == 0 || done == rows) {
+            shunting_end_operation(context);
+            const std::coroutine_handle<> awaiting {waiting};
+            awaiting.resume();
+            return;
+        }
+
+        const executor next {loop};
+        next([this] { slice(); });
+    }
+
+    workerPool &pool;
+    executor loop;
+    shunting_context *context;
+    const shunting_program *program;
+    std::vector<const float *> columns;
+    size_t rows;
+    float *results;
+    size_t done {0};
+    int status {1};
+    std::coroutine_handle<> waiting {};
+};
+
+inline compileOperation compile(workerPool &pool, executor loop, shunting_context *context, std::string expression) {
+    return {pool, std::move(loop), context, std::move(expression)};
+}
+
+/* columns holds one column per variable of program, as for shunting_evaluate_batch. */
+inline batchOperation evaluateBatch(workerPool &pool, executor loop, shunting_context *context, const shunting_program *program,
+                                    std::vector<const float *> columns, size_t rows, float *results) {
+    return {pool, std::move(loop), context, program, std::move(columns), rows, results};
+}
+
+}
+
+#endif
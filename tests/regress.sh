@@ -0,0 +1,264 @@
+#!/bin/sh
+# Regression checks for the calculator's command line, run against a built binary:
+#
+#     g++ -std=c++20 -O2 -pthread -o calculator Evaluator.cpp
+#     tests/regress.sh ./calculator
+#
+# Each check feeds lines on stdin (pipe mode), or as a --batch-file, and
+# compares the output; an exit status above 1 means a crash. Exits 1 if any
+# check fails.
+
+calc=${1:-./calculator}
+failures=0
+scratch=$(mktemp)
+trap 'rm -f "$scratch" "$scratch.snap"' EXIT
+
+# compare <name> <expected output> <actual output> <exit status>
+compare() {
+    if [ "$4" -gt 1 ] || [ "$3" != "$2" ]; then
+        printf 'FAIL %s (exit %s)\n--- expected\n%s\n--- actual\n%s\n' "$1" "$4" "$2" "$3"
+        failures=$((failures + 1))
+    fi
+}
+
+# check <name> <expected output> <input> [flags...]
+check() {
+    name=$1 expected=$2 input=$3
+    shift 3
+    actual=$(printf '%s\n' "$input" | "$calc" "$@" 2>&1)
+    compare "$name" "$expected" "$actual" $?
+}
+
+# check_file <name> <expected output> <file contents> [flags...]
+check_file() {
+    name=$1 expected=$2
+    printf '%s\n' "$3" > "$scratch"
+    shift 3
+    actual=$("$calc" --batch-file "$scratch" "$@" 2>&1 < /dev/null)
+    compare "$name" "$expected" "$actual" $?
+}
+
+# Long operand chains under a branch are lowered without recursion.
+check "long chain under ?:" "Defined.
+1" "x = 1
+$(awk 'BEGIN { for (i = 1; i < 100000; ++i) printf "x + "; print "x > 0 ? 1 : 2" }')"
+
+# Defining thousands of variables and functions one line at a time finishes well within the timeout.
+actual=$(awk 'BEGIN { for (i = 0; i < 8000; ++i) print "v" i " = " i; print "v0 + v4000 + v7999" }' | timeout 5 "$calc" 2>&1 | tail -n 1)
+compare "many variables" "11999" "$actual" $?
+actual=$(awk 'BEGIN { for (i = 0; i < 8000; ++i) print "f" i "(x) = x + " i; print "f0(1) + f7999(1)" }' | timeout 5 "$calc" 2>&1 | tail -n 1)
+compare "many functions" "8001" "$actual" $?
+
+# Literals beyond float range fail instead of aborting.
+check "literal overflow" "Number too large: 1234567890123456789012345678901234567890123" \
+    "1234567890123456789012345678901234567890123"
+
+# Decimal mode edge cases at the ends of int64_t.
+check "decimal min % -1" "0" "(0 - 9223372036854775807 - 1) % (0 - 1)" --decimal 0
+check "decimal pow min exponent" "1
+1" "1 ^ (0 - 9223372036854775807 - 1)
+(0 - 1) ^ (0 - 9223372036854775807 - 1)" --decimal 0
+check "decimal builtins" "1.12
+4.50
+2.00
+sqrt is not exact in decimal mode" "0.125 + 1.005
+min(1.5, 2) * abs(0 - 3)
+floor(2.5)
+sqrt(2)" --decimal 2
+check "decimal half even" "1.88
+0.02
+-0.08" "1.25 * 1.5
+0.05 * 0.5
+(0 - 0.15) * 0.5" --decimal 2
+
+# Series bounds must be finite and span at most 2^24 terms.
+check "sum infinite bound" "Bounds of sum must be finite" "sum(i, 1, 1 / 0, 1)"
+check "sum negative infinite bound" "Bounds of sum must be finite" "sum(i, 0 - 1 / 0, 1, 1)"
+check "sum too many terms" "sum over more than 2^24 terms" "sum(i, 1, 10 ^ 20, 1)"
+check "sum beyond size_t" "sum over more than 2^24 terms" "sum(i, 1, 2 ^ 64 * 4, 1)"
+check "sum within range" "120
+0" "prod(i, 1, 5, i)
+sum(i, 3, 1, i)"
+
+# Batch files only reuse results of repeats between the same two definitions.
+check_file "batch file definitions" "Defined.
+1
+Defined.
+2
+Defined.
+Defined.
+4" "a = 1
+a
+a = 2
+a
+a = a + 1
+a = a + 1
+a"
+check_file "batch file flushes before an error" "2
+2
+Missing operand: (+, 0, 0.000000, [6 : add])" "1 + 1
+1 + 1
+1 +
+3"
+
+# Builtins in bignum mode.
+check "bignum builtins" "35
+-1
+sqrt is not exact in bignum mode" "abs(0 - 5) + min(3, 4) * max(2, 7) + floor(9)
+min(0 - 1, 2)
+sqrt(4)" --bignum
+
+# Builtins in complex mode, one row at a time and in batch.
+check "complex builtins" "8.58727 - 0.773014i
+min is not defined for complex numbers" "sqrt(0 - 4) + exp(2i) * sin(1 + 1i) / cos(2) - log(3i) + floor(2.5 + 1.5i) + abs(3 + 4i)
+min(1, 2)" --complex
+check "complex batch builtins" "-2.06215 + 5.20595i
+-1.81129 - 0.144949i
+122.228 - 189.43i" "1 2
+-0.5 3
+4 -1" --complex --batch "sqrt(x) + abs(x) * exp(x) - log(x)"
+
+# Special forms, and solve through the derivative of every builtin.
+check "special forms" "1.41421
+1.98616
+385
+120
+9" "solve(x ^ 2 - 2, x, 1, 2)
+solve(exp(x) + sin(x) * cos(x) - max(x, 3) + min(x, 1) + abs(x) + sqrt(x) + log(x) + floor(x) - 10, x, 1, 3)
+sum(k, 1, 10, k ^ 2)
+prod(k, 1, 5, k)
+integrate(x ^ 2, x, 0, 3)"
+
+# A variable that was never assigned is unbound, even once a later slot has a value.
+check "unassigned variable" "Defined.
+Defined.
+Unbound variable: y" "f(a) = a + y
+x = 2
+f(1)"
+
+check "unassigned variable in decimal mode" "Defined.
+Defined.
+Unbound variable: y" "f(a) = a + y
+x = 2
+f(1)" --decimal 2
+check "unassigned variable in bignum mode" "Defined.
+Unbound variable: y" "x = 2
+x + y" --bignum
+check "unassigned variable in complex mode" "Defined.
+Unbound variable: y" "x = 2
+x * y" --complex
+
+# ... and stays unbound across a snapshot.
+printf 'f(a) = a + y\nx = 2\n' | "$calc" --snapshot "$scratch.snap" > /dev/null 2>&1
+check "unassigned variable in snapshot" "Unbound variable: y" "f(1)" --snapshot "$scratch.snap"
+rm -f "$scratch.snap"
+
+# A truncated snapshot fails cleanly instead of reading past its end.
+printf 'a = 2\nf(x) = x * a\nf(3)\n' | "$calc" --snapshot "$scratch.snap" > /dev/null 2>&1
+head -c 200 "$scratch.snap" > "$scratch.cut" && mv "$scratch.cut" "$scratch.snap"
+check "truncated snapshot" "Corrupt snapshot or shared cache" "f(3)" --snapshot "$scratch.snap"
+rm -f "$scratch.snap"
+
+# Snapshots holding programs compile could not have produced fail cleanly: a
+# top-level form without its lowered body, and forms nested 100000 deep.
+if command -v python3 > /dev/null; then
+    for shape in bodiless deep; do
+        python3 - "$scratch.snap" "$shape" <<'EOF'
+import struct, sys
+
+def fnv1a(text):
+    h = 14695981039346656037
+    for c in text.encode():
+        h = ((h ^ c) * 1099511628211) % 2**64
+    return h
+
+def mix64(h):
+    h ^= h >> 33
+    h = (h * 0xff51afd7ed558ccd) % 2**64
+    h ^= h >> 33
+    h = (h * 0xc4ceb9fe1a85ec53) % 2**64
+    return h ^ (h >> 33)
+
+def string(data):
+    return struct.pack("<I", len(data)) + data
+
+def token(kind, flags=0, argc=0, slot=0, value=0.0, text=b""):
+    return struct.pack("<BBIIqf", kind, flags, argc, slot, 0, value) + string(text)
+
+i32, var, form, sum_ = 9, 13, 31, 1
+literal = lambda v: token(i32, value=v, text=b"%d" % v)
+
+if sys.argv[2] == "bodiless":
+    program = struct.pack("<I", 5) + b"".join(literal(v) for v in (1, 2, 3, 4)) + token(form, argc=4, slot=sum_)
+else:
+    depth = 100000
+    outer = struct.pack("<I", 3) + literal(1) + literal(1) + token(form, flags=4, argc=2, slot=sum_) + string(b"i")
+    program = outer * depth + struct.pack("<I", 1) + token(var, text=b"i")
+
+out = bytearray(64)
+def align():
+    out.extend(b"\0" * (-len(out) % 8))
+    return len(out)
+
+program_at = align()
+out += string(program)
+text_at = align()
+out += string(b"t")
+table_at = align()
+out += struct.pack("<QQQ", mix64(fnv1a("t")), text_at, program_at)
+keys_at = align()
+out[:64] = struct.pack("<8Q", 0x5359535300000002, 0, 0, 0, table_at, 1, keys_at, 0)
+open(sys.argv[1], "wb").write(out)
+EOF
+        check "$shape program in snapshot" "Corrupt snapshot or shared cache" "t" --snapshot "$scratch.snap"
+    done
+    rm -f "$scratch.snap"
+fi
+
+# Forms nest at most 256 deep.
+check "form nesting" "Forms nested more than 256 deep" \
+    "$(awk 'BEGIN { for (i = 0; i < 257; ++i) printf "sum(i, 1, 1, "; printf "i"; for (i = 0; i < 257; ++i) printf ")"; print "" }')"
+
+# The server applies every one of concurrent definitions and survives bad input.
+if command -v python3 > /dev/null; then
+    port=$((20000 + $$ % 20000))
+    "$calc" --serve "$port" > /dev/null 2>&1 &
+    server=$!
+    sleep 0.5
+
+    actual=$(python3 - "$port" <<'EOF'
+import socket, sys, threading, time
+
+def ask(*lines):
+    with socket.create_connection(("127.0.0.1", int(sys.argv[1])), timeout=10) as s:
+        f = s.makefile("rw")
+        replies = []
+        for line in lines:
+            f.write(line + "\n")
+            f.flush()
+            replies.append(f.readline().strip())
+        return replies
+
+# A slow expression holds the environment while the definitions queue up behind it.
+ask("a = 0")
+slow = threading.Thread(target=ask, args=("sum(i, 1, 2 ^ 24, sin(i))",))
+slow.start()
+time.sleep(0.2)
+clients = [threading.Thread(target=ask, args=("a = a + 1",)) for _ in range(20)]
+for c in clients: c.start()
+for c in clients + [slow]: c.join()
+print("\n".join(ask("a", "1234567890123456789012345678901234567890123", "2 * 3")))
+EOF
+)
+    kill "$server"
+    compare "server" "20
+error: Number too large: 1234567890123456789012345678901234567890123
+6" "$actual" 0
+fi
+
+if [ "$failures" -gt 0 ]; then
+    echo "$failures check(s) failed"
+    exit 1
+fi
+
+echo "All checks passed"